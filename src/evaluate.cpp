@@ -103,9 +103,14 @@ namespace Eval {
         {
             if (directory != "<internal>")
             {
-                ifstream stream(directory + eval_file, ios::binary);
-                if (load_eval(eval_file, stream))
+                if (load_prepared(eval_file, directory + eval_file))
                     eval_file_loaded = eval_file;
+                else
+                {
+                    ifstream stream(directory + eval_file, ios::binary);
+                    if (load_eval(eval_file, stream))
+                        eval_file_loaded = eval_file;
+                }
             }
 
             if (directory == "<internal>" && eval_file == EvalFileDefaultName)
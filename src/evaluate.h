@@ -48,11 +48,16 @@ namespace Eval {
 
     std::string trace(Position& pos);
     Value evaluate(const Position& pos, bool adjusted = false);
+    void evaluate_batch(const Position* const* positions, Value* values, std::size_t count, bool adjusted = false);
+    void evaluate_batch_file(int argc, char* argv[]);
+    void bench_layers(const Position& pos, int iterations);
 
     void init();
     void verify();
 
     bool load_eval(std::string name, std::istream& stream);
+    bool load_prepared(const std::string& name, const std::string& path);
+    void prepare_net(int argc, char* argv[]);
     bool save_eval(std::ostream& stream);
     bool save_eval(const std::optional<std::string>& filename);
 
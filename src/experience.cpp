@@ -24,6 +24,9 @@
 #include <fstream>
 #include <vector>
 #include <stdio.h> //For: remove()
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
@@ -36,63 +39,6 @@
 using namespace std;
 using namespace Stockfish;
 
-#define USE_GOOGLE_SPARSEHASH_DENSEMAP
-#define USE_CUSTOM_HASHER
-
-#ifdef USE_GOOGLE_SPARSEHASH_DENSEMAP
-    #include "sparsehash/dense_hash_map"
-    
-    #ifdef USE_CUSTOM_HASHER
-        //Custom Hash functor for "Key" type
-        struct KeyHasher
-        {
-            //Hash operator
-            inline size_t operator()(const Stockfish::Key& key) const
-            {
-                return key & 0x00000000FFFFFFFFULL;
-            }
-
-            //Compare operator
-            inline bool operator()(const Stockfish::Key& key1, const Stockfish::Key& key2) const
-            {
-                return key1 == key2;
-            }
-        };
-
-        template<typename tKey, typename tVal> class SugaRMap : public google::dense_hash_map<tKey, tVal, KeyHasher, KeyHasher>
-        {
-        public:
-            SugaRMap(tKey emptyKey, tKey deletedKey)
-            {
-                google::dense_hash_map<tKey, tVal, KeyHasher, KeyHasher>::set_empty_key(emptyKey);
-                google::dense_hash_map<tKey, tVal, KeyHasher, KeyHasher>::set_deleted_key(deletedKey);
-            }
-        };
-    #else
-        template<typename tKey, typename tVal> class SugaRMap : public google::dense_hash_map<tKey, tVal>
-        {
-        public:
-            SugaRMap(tKey emptyKey, tKey deletedKey)
-            {
-                google::dense_hash_map<tKey, tVal>::set_empty_key(emptyKey);
-                google::dense_hash_map<tKey, tVal>::set_deleted_key(deletedKey);
-            }
-        };
-    #endif
-
-    template<typename tVal> class SugaRKeyMap : public SugaRMap<Stockfish::Key, tVal>
-    {
-    public:
-        SugaRKeyMap() : SugaRMap<Key, tVal>((Key)0, (Key)-1)
-        {
-        }
-    };
-#else
-    #include <unordered_map>
-    template<typename tKey, typename tVal> using SugaRMap = unordered_map<tKey, tVal>;
-    template<typename tVal> using SugaRKeyMap = SugaRMap<Key, tVal>;
-#endif
-
 namespace Experience
 {
     class ExperienceReader
@@ -265,11 +211,146 @@ namespace Experience
     }
 
     ////////////////////////////////////////////////////////////////
-    // Typedefs
+    // V3
+    //
+    // File layout:
+    //  - FileHeader
+    //  - The entries sorted by position key, the moves of a position are
+    //    stored best first with their next flag set as in ExpEntryEx
+    //  - Position index, aligned to 64 bytes: open addressing over buckets
+    //    of 4 slots holding the key and the first entry of a position
+    //  - Journal: entries appended since the file was written
+    //
+    // The file is mapped and probed in place, so only the journal needs to
+    // be read at startup and the pages are shared by all the processes using
+    // the same file. Saving the whole experience folds the journal back in.
     ////////////////////////////////////////////////////////////////
-    typedef SugaRKeyMap<ExpEntryEx*> ExpMap;
-    typedef SugaRKeyMap<ExpEntryEx*>::iterator ExpIterator;
-    typedef SugaRKeyMap<ExpEntryEx*>::const_iterator ExpConstIterator;
+    namespace V3
+    {
+        const string ExperienceSignature = "SugaR Experience version 3";
+        const int    ExperienceVersion = 3;
+
+        struct FileHeader
+        {
+            char     signature[32];
+            uint64_t entryCount;    //Sorted entries
+            uint64_t positionCount; //Positions in the index
+            uint64_t bucketCount;   //Index buckets
+            uint64_t journalOffset; //End of the index and start of the journal
+        };
+
+        static_assert(sizeof(FileHeader) == 64);
+
+        struct IndexSlot
+        {
+            Key      key;           //0 if the slot is empty
+            uint64_t entry;         //First entry of the position
+        };
+
+        struct IndexBucket
+        {
+            IndexSlot slot[4];
+        };
+
+        static_assert(sizeof(IndexBucket) == 64);
+
+        inline size_t index_offset(uint64_t entryCount)
+        {
+            size_t entriesEnd = sizeof(FileHeader) + entryCount * sizeof(ExpEntry);
+            return (entriesEnd + sizeof(IndexBucket) - 1) / sizeof(IndexBucket) * sizeof(IndexBucket);
+        }
+
+        FileHeader make_header(uint64_t entryCount, uint64_t positionCount, uint64_t bucketCount)
+        {
+            FileHeader h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.signature, ExperienceSignature.c_str(), ExperienceSignature.length());
+            h.entryCount = entryCount;
+            h.positionCount = positionCount;
+            h.bucketCount = bucketCount;
+            h.journalOffset = index_offset(entryCount) + bucketCount * sizeof(IndexBucket);
+
+            return h;
+        }
+
+        bool check_header(const FileHeader& h, size_t fileSize)
+        {
+            return   memcmp(h.signature, ExperienceSignature.c_str(), ExperienceSignature.length() + 1) == 0
+                  && h.entryCount <= fileSize / sizeof(ExpEntry)
+                  && h.bucketCount <= fileSize / sizeof(IndexBucket)
+                  && h.positionCount <= h.entryCount
+                  && (!h.positionCount || h.positionCount < h.bucketCount * 4) //Never full
+                  && h.journalOffset == index_offset(h.entryCount) + h.bucketCount * sizeof(IndexBucket)
+                  && h.journalOffset <= fileSize
+                  && (fileSize - h.journalOffset) % sizeof(ExpEntry) == 0;
+        }
+
+        class ExperienceReader : public Experience::ExperienceReader
+        {
+        private:
+            FileHeader header;
+            size_t     entriesRead;
+
+        public:
+            explicit ExperienceReader() : entriesRead(0) {}
+
+        public:
+            virtual int get_version()
+            {
+                return ExperienceVersion;
+            }
+
+            virtual bool check_signature(ifstream& input, size_t inputLength)
+            {
+                match = false;
+                entriesCount = 0;
+
+                input.seekg(0, ios::beg);
+                if (   inputLength < sizeof(FileHeader)
+                    || !input.read((char*)&header, sizeof(FileHeader))
+                    || !check_header(header, inputLength))
+                {
+                    input.clear();
+                    input.seekg(0, ios::beg);
+                    return false;
+                }
+
+                entriesCount = header.entryCount + (inputLength - header.journalOffset) / sizeof(ExpEntry);
+                entriesRead = 0;
+                match = true;
+
+                return true;
+            }
+
+            virtual bool read(ifstream& input, Current::ExpEntry* exp)
+            {
+                assert(match && input.is_open());
+
+                //Continue with the journal after the sorted entries
+                if (entriesRead++ == header.entryCount)
+                    input.seekg(header.journalOffset, ios::beg);
+
+                if (!input.read((char*)exp, sizeof(ExpEntry)))
+                    return false;
+
+                return true;
+            }
+
+            const FileHeader& file_header() const
+            {
+                return header;
+            }
+
+            //The sorted entries are probed in place, only read the journal
+            void skip_sorted()
+            {
+                assert(match);
+
+                entriesCount -= header.entryCount - entriesRead;
+                entriesRead = header.entryCount;
+            }
+        };
+    }
 
     ////////////////////////////////////////////////////////////////
     // ExpEntryEx::quality
@@ -330,13 +411,13 @@ namespace Experience
                     break;
 
                 //Find best next experience move (shallow search)
-                const ExpEntryEx* temp2 = temp1 ? temp1->next : nullptr;
+                const ExpEntryEx* temp2 = temp1 ? temp1->next() : nullptr;
                 while (temp2)
                 {
                     if (temp2->compare(temp1) > 0)
                         temp1 = temp2;
 
-                    temp2 = temp2->next;
+                    temp2 = temp2->next();
                 }
 
                 if (lastExp[me])
@@ -388,18 +469,300 @@ namespace Experience
 #else
         constexpr size_t WriteBufferSize = 1024 * 1024 * 16;
 #endif
-        
+
+        //Experience entries are allocated in chunks of (at least) this many entries
+        constexpr size_t ChunkEntries = 64 * 1024;
+
+        //Readers of all the experience file versions
+        class ExpReaders
+        {
+        public:
+            vector<pair<const char*, ExperienceReader*>> readers;
+
+        public:
+            //Order should be from most recent to oldest
+            ExpReaders()
+            {
+                readers.emplace_back("Experience (V3) reader", new V3::ExperienceReader());
+                readers.emplace_back("Experience (V2) reader", new V2::ExperienceReader());
+                readers.emplace_back("Experience (V1) reader", new V1::ExperienceReader());
+
+#ifndef NDEBUG
+                int latest = 0;
+                for (auto& rp : readers)
+                    latest += rp.second->get_version() == Current::ExperienceVersion ? 1 : 0;
+
+                assert(latest == 1);
+#endif
+            }
+
+            ~ExpReaders()
+            {
+                for (auto rp : readers)
+                    delete rp.second;
+            }
+        };
+
+        //Open an experience file and find the reader of its version
+        ExperienceReader* open_experience_file(const string& fn, ifstream& in, size_t& inSize, ExpReaders& expReaders)
+        {
+            in.open(Utility::map_path(fn), ios::in | ios::binary | ios::ate);
+            if (!in.is_open())
+            {
+                sync_cout << "info string Could not open experience file: " << fn << sync_endl;
+                return nullptr;
+            }
+
+            inSize = in.tellg();
+            if (inSize == 0)
+            {
+                sync_cout << "info string The experience file [" << fn << "] is empty" << sync_endl;
+                return nullptr;
+            }
+
+            for (auto &rp : expReaders.readers)
+            {
+                if (!rp.second)
+                {
+                    sync_cout << "info string Could not allocate memory for " << rp.first << sync_endl;
+                    continue;
+                }
+
+                if (rp.second->check_signature(in, inSize))
+                    return rp.second;
+            }
+
+            sync_cout << "info string The file [" << fn << "] is not a valid experience file" << sync_endl;
+            return nullptr;
+        }
+
+        //Rename an experience file to its backup file, returns the name of the backup
+        //or an empty string if the backup could not be made
+        string backup_file(const string& expFilename)
+        {
+            string backupExpFilename = expFilename + ".bak";
+
+            //If backup file already exists then delete it
+            if (Utility::file_exists(backupExpFilename))
+            {
+                if (remove(backupExpFilename.c_str()) != 0)
+                {
+                    sync_cout << "info string Could not deleted existing backup file: " << backupExpFilename << sync_endl;
+                    return string();
+                }
+            }
+
+            //Rename current experience file
+            if (rename(expFilename.c_str(), backupExpFilename.c_str()) != 0)
+            {
+                sync_cout << "info string Could not create backup of current experience file" << sync_endl;
+                return string();
+            }
+
+            return backupExpFilename;
+        }
+
+        //Restore the backup made by backup_file() after a failure to save
+        void restore_backup(const string& expFilename, const string& backupExpFilename)
+        {
+            if (!backupExpFilename.empty() && rename(backupExpFilename.c_str(), expFilename.c_str()) != 0)
+                sync_cout << "info string Could not restore backup experience file: " << backupExpFilename << sync_endl;
+        }
+
+        ////////////////////////////////////////////////////////////////
+        // ExpIndex: Maps a position key to the block of its experience moves
+        //
+        // Open addressing over cache line sized buckets of 4 slots, a probe
+        // scans the home bucket and continues into the next bucket only when
+        // it is full, so a lookup usually touches one cache line.
+        //
+        // There is a single writer at a time while search threads probe
+        // concurrently: the block of a slot is published before its key,
+        // published blocks are never modified (changes are copied into a new
+        // block which replaces the old one) and a grown table replaces the old
+        // one atomically. Replaced tables are freed by clear(), when nobody is
+        // probing anymore.
+        ////////////////////////////////////////////////////////////////
+        class ExpIndex
+        {
+        private:
+            struct Slot
+            {
+                atomic<Key>               key;
+                atomic<const ExpEntryEx*> block;
+            };
+
+            static constexpr size_t SlotsPerBucket = 4;
+
+            struct alignas(64) Bucket
+            {
+                Slot slot[SlotsPerBucket];
+            };
+
+            static_assert(sizeof(Bucket) == 64, "Unexpected Bucket size");
+
+            struct Table
+            {
+                size_t  bucketCount;
+                Bucket* buckets;
+            };
+
+            atomic<Table*> _table;
+            vector<Table*> _tables; //Current and replaced tables
+            size_t         _size;
+
+            //Slot holding 'k' or the empty slot where 'k' is to be inserted.
+            //Key 0 marks an empty slot and the table is never full
+            static Slot* find_slot(const Table* t, Key k)
+            {
+                size_t b = (size_t)mul_hi64(k, t->bucketCount);
+                while (true)
+                {
+                    for (Slot& s : t->buckets[b].slot)
+                    {
+                        Key sk = s.key.load(memory_order_acquire);
+                        if (sk == k || !sk)
+                            return &s;
+                    }
+
+                    if (++b == t->bucketCount)
+                        b = 0;
+                }
+            }
+
+        public:
+            ExpIndex() : _table(nullptr), _size(0) {}
+
+            ~ExpIndex()
+            {
+                clear();
+            }
+
+            void clear()
+            {
+                for (Table* t : _tables)
+                {
+                    std_aligned_free(t->buckets);
+                    delete t;
+                }
+
+                _tables.clear();
+                _table.store(nullptr, memory_order_release);
+                _size = 0;
+            }
+
+            size_t size() const
+            {
+                return _size;
+            }
+
+            const ExpEntryEx* probe(Key k) const
+            {
+                const Table* t = _table.load(memory_order_acquire);
+                if (!t)
+                    return nullptr;
+
+                const Slot* s = find_slot(t, k);
+                return s->key.load(memory_order_acquire) == k ? s->block.load(memory_order_acquire) : nullptr;
+            }
+
+            //Grow the table, if needed, so that 'count' more positions can be inserted
+            bool reserve(size_t count)
+            {
+                Table* t = _table.load(memory_order_relaxed);
+                size_t needed = _size + count;
+                if (t && needed * 4 <= t->bucketCount * SlotsPerBucket * 3)
+                    return true;
+
+                size_t bucketCount = t ? t->bucketCount * 2 : 256;
+                while (needed * 4 > bucketCount * SlotsPerBucket * 3)
+                    bucketCount *= 2;
+
+                Bucket* buckets = (Bucket*)std_aligned_alloc(alignof(Bucket), bucketCount * sizeof(Bucket));
+                if (!buckets)
+                    return false;
+
+                memset((void*)buckets, 0, bucketCount * sizeof(Bucket));
+                Table* nt = new Table{ bucketCount, buckets };
+
+                //Rehash, the new table is not visible to readers yet
+                if (t)
+                    for (size_t i = 0; i < t->bucketCount; ++i)
+                        for (const Slot& s : t->buckets[i].slot)
+                        {
+                            Key k = s.key.load(memory_order_relaxed);
+                            if (!k)
+                                continue;
+
+                            Slot* ns = find_slot(nt, k);
+                            ns->block.store(s.block.load(memory_order_relaxed), memory_order_relaxed);
+                            ns->key.store(k, memory_order_relaxed);
+                        }
+
+                _tables.push_back(nt);
+                _table.store(nt, memory_order_release);
+
+                return true;
+            }
+
+            //Publish 'block' as the moves of position 'k'. A new position needs a
+            //previous reserve()
+            void set(Key k, const ExpEntryEx* block)
+            {
+                Slot* s = find_slot(_table.load(memory_order_relaxed), k);
+                s->block.store(block, memory_order_release);
+
+                if (!s->key.load(memory_order_relaxed))
+                {
+                    s->key.store(k, memory_order_release);
+                    ++_size;
+                }
+            }
+
+            //Call 'f' with the key and block of every position, stop as soon as 'f' returns false
+            template<typename Function>
+            bool for_each(Function f) const
+            {
+                const Table* t = _table.load(memory_order_acquire);
+                if (!t)
+                    return true;
+
+                for (size_t i = 0; i < t->bucketCount; ++i)
+                    for (const Slot& s : t->buckets[i].slot)
+                    {
+                        Key k = s.key.load(memory_order_acquire);
+                        if (k && !f(k, s.block.load(memory_order_acquire)))
+                            return false;
+                    }
+
+                return true;
+            }
+        };
+
         class ExperienceData
         {
         private:
             string              _filename;
 
-            vector<ExpEntryEx*> _expData;
+            vector<ExpEntryEx*> _expData;    //Chunks holding the blocks of '_mainExp'
+            size_t              _chunkUsed;
+            size_t              _chunkSize;
+            vector<char>        _linkBuffer;
+
             vector<ExpEntryEx*> _newPvExp;
             vector<ExpEntryEx*> _newMultiPvExp;
-            vector<ExpEntryEx*> _oldExpData;
 
-            ExpMap              _mainExp;
+            ExpIndex            _mainExp;
+            mutex               _writerMutex;
+
+            //Mapped version 3 file, '_mainExp' holds the positions changed since
+            MemoryMappedFile    _mapped;
+            const ExpEntryEx*   _mappedEntries;
+            const V3::IndexBucket* _mappedIndex;
+            size_t              _mappedEntryCount;
+            size_t              _mappedBucketCount;
+            size_t              _mappedPositionCount;
+            size_t              _overlaidCount;  //Mapped positions also in '_mainExp'
 
             bool                _loading;
             atomic<bool>        _abortLoading;
@@ -416,205 +779,286 @@ namespace Experience
                 wait_for_load_finished();
                 assert(_loaderThread == nullptr);
 
-                //Clear new exp (this will also flush all new experience data to '_oldExpData' which we will delete later in this function
+                //Delete new exp data, '_mainExp' has its own copy
                 clear_new_exp();
 
                 //Free main exp data
+                _mainExp.clear();
+
                 for (ExpEntryEx *&p : _expData)
                     free(p);
 
-                //Delete previous game experience data
-                for (ExpEntryEx*& p : _oldExpData)
-                    delete p;
-
-                //Clear
-                _mainExp.clear();
-                _oldExpData.clear();
                 _expData.clear();
+                _chunkUsed = _chunkSize = 0;
+
+                unmap();
             }
 
-            void clear_new_exp()
+            void unmap()
             {
-                //Copy exp data to another buffer to be deleted when the whole object is destroyed or new exp file is loaded
-                for (auto& newExp : { _newPvExp, _newMultiPvExp })
-                    std::copy(newExp.begin(), newExp.end(), back_inserter(_oldExpData));
-
-                //Clear vectors
-                _newPvExp.clear();
-                _newMultiPvExp.clear();
+                _mapped.unmap();
+                _mappedEntries = nullptr;
+                _mappedIndex = nullptr;
+                _mappedEntryCount = _mappedBucketCount = _mappedPositionCount = _overlaidCount = 0;
             }
 
-            bool link_entry(ExpEntryEx* exp)
+            bool map(const string& fn, const V3::FileHeader& h)
             {
-                ExpIterator itr = _mainExp.find(exp->key);
-
-                //If new entry: insert into map and continue
-                if (itr == _mainExp.end())
+                if (!_mapped.map(Utility::map_path(fn), false) || _mapped.size() < h.journalOffset)
                 {
-                    _mainExp[exp->key] = exp;
-                    return true;
+                    unmap();
+                    return false;
                 }
 
-                //If existing entry and same move exists then merge
-                ExpEntryEx* exp2 = itr->second->find(exp->move);
-                if (exp2)
+                _mappedEntries = reinterpret_cast<const ExpEntryEx*>(_mapped.data() + sizeof(V3::FileHeader));
+                _mappedIndex = reinterpret_cast<const V3::IndexBucket*>(_mapped.data() + V3::index_offset(h.entryCount));
+                _mappedEntryCount = h.entryCount;
+                _mappedBucketCount = h.bucketCount;
+                _mappedPositionCount = h.positionCount;
+
+                //The moves of the last position must not run past the entries
+                if (_mappedEntryCount && _mappedEntries[_mappedEntryCount - 1].next())
                 {
-                    exp2->merge(exp);
+                    unmap();
                     return false;
                 }
 
-                //If existing entry and different move then insert sorted based on pseudo-quality
-                exp2 = itr->second;
-                do
+                return true;
+            }
+
+            const ExpEntryEx* probe_mapped(Key k) const
+            {
+                if (!_mappedBucketCount)
+                    return nullptr;
+
+                size_t b = (size_t)mul_hi64(k, _mappedBucketCount);
+                for (size_t n = 0; n < _mappedBucketCount; ++n)
                 {
-                    if (exp->compare(exp2) > 0)
+                    for (const V3::IndexSlot& slot : _mappedIndex[b].slot)
                     {
-                        if (exp2 == itr->second)
-                        {
-                            itr->second = exp;
-                            exp->next = exp2;
-                        }
-                        else
-                        {
-                            exp->next = exp2->next;
-                            exp2->next = exp;
-                        }
+                        if (slot.key == k)
+                            return slot.entry < _mappedEntryCount ? _mappedEntries + slot.entry : nullptr;
 
-                        return true;
+                        if (!slot.key)
+                            return nullptr;
                     }
 
-                    if (!exp2->next)
-                    {
-                        exp2->next = exp;
-                        return true;
-                    }
+                    if (++b == _mappedBucketCount)
+                        b = 0;
+                }
 
-                    exp2 = exp2->next;
-                } while (true);
+                return nullptr;
+            }
 
-                //Should never reach here!
-                assert(false);
-                return true;
+            size_t position_count() const
+            {
+                return _mappedPositionCount + _mainExp.size() - _overlaidCount;
             }
 
-            bool _load(string fn)
+            void clear_new_exp()
             {
-                ifstream in(Utility::map_path(fn), ios::in | ios::binary | ios::ate);
-                if (!in.is_open())
+                for (auto* newExp : { &_newPvExp, &_newMultiPvExp })
                 {
-                    sync_cout << "info string Could not open experience file: " << fn << sync_endl;
-                    return false;
+                    for (ExpEntryEx* p : *newExp)
+                        delete p;
+
+                    newExp->clear();
                 }
+            }
 
-                size_t inSize = in.tellg();
-                if (inSize == 0)
-                {
-                    sync_cout << "info string The experience file [" << fn << "] is empty" << sync_endl;
+            //Make sure the current chunk has room for 'count' more entries
+            bool reserve_entries(size_t count)
+            {
+                if (_chunkUsed + count <= _chunkSize)
+                    return true;
+
+                size_t chunkSize = max(count, ChunkEntries);
+                ExpEntryEx* chunk = (ExpEntryEx*)malloc(chunkSize * sizeof(ExpEntryEx));
+                if (!chunk)
                     return false;
-                }
 
-                //Define readers
-                //Order should be from most recent to oldest
-                class ExpReaders
-                {
-                public:
-                    vector<pair<const char*, ExperienceReader*>> readers;
+                _expData.push_back(chunk);
+                _chunkUsed = 0;
+                _chunkSize = chunkSize;
 
-                public:
-                    ExpReaders()
-                    {
-                        readers.emplace_back("Experience (V2) reader", new V2::ExperienceReader());
-                        readers.emplace_back("Experience (V1) reader", new V1::ExperienceReader());
+                return true;
+            }
 
-#ifndef NDEBUG
-                        int latest = 0;
-                        for (auto& rp : readers)
-                            latest += rp.second->get_version() == Current::ExperienceVersion ? 1 : 0;
+            //Merge 'count' entries of the same position with the moves already known
+            //for that position and publish the result as a new block: same moves are
+            //merged in order, different moves are sorted based on pseudo-quality.
+            //Caller must hold '_writerMutex'
+            bool link_entries(const Current::ExpEntry* const* exps, size_t count, size_t& duplicateMoves)
+            {
+                const Key key = exps[0]->key;
+                if (!key)
+                    return true; //Reserved for empty slots
 
-                        assert(latest == 1);
-#endif
-                    }
+                const ExpEntryEx* oldBlock = _mainExp.probe(key);
+                const bool newKey = !oldBlock;
 
-                    ~ExpReaders()
-                    {
-                        for (auto rp : readers)
-                            delete rp.second;
-                    }
-                }expReaders;
+                if (!oldBlock)
+                    oldBlock = probe_mapped(key);
+
+                size_t oldCount = 0;
+                for (const ExpEntryEx* exp = oldBlock; exp; exp = exp->next())
+                    ++oldCount;
+
+                //Build the new block in a work buffer
+                _linkBuffer.resize((oldCount + count + 1) * sizeof(ExpEntryEx));
+                ExpEntryEx* work = reinterpret_cast<ExpEntryEx*>(_linkBuffer.data());
+                ExpEntryEx* temp = work + oldCount + count;
 
-                ExperienceReader *reader = nullptr;
-                for (auto &rp : expReaders.readers)
+                if (oldCount)
+                    memcpy((void*)work, oldBlock, oldCount * sizeof(ExpEntryEx));
+
+                size_t moves = oldCount;
+                for (size_t i = 0; i < count; ++i)
                 {
-                    if (!rp.second)
+                    assert(exps[i]->key == key);
+
+                    size_t j = 0;
+                    while (j < moves && work[j].move != exps[i]->move)
+                        ++j;
+
+                    if (j < moves)
                     {
-                        sync_cout << "info string Could not allocate memory for " << rp.first << sync_endl;
-                        continue;
+                        work[j].merge(exps[i]);
+                        ++duplicateMoves;
                     }
+                    else
+                        memcpy((void*)&work[moves++], exps[i], sizeof(ExpEntryEx));
+                }
 
-                    if (rp.second->check_signature(in, inSize))
+                //Insertion sort, there are only a few moves per position
+                for (size_t i = 1; i < moves; ++i)
+                    for (size_t j = i; j > 0 && work[j].compare(&work[j - 1]) > 0; --j)
                     {
-                        reader = rp.second;
-                        break;
+                        memcpy((void*)temp, &work[j], sizeof(ExpEntryEx));
+                        memcpy((void*)&work[j], &work[j - 1], sizeof(ExpEntryEx));
+                        memcpy((void*)&work[j - 1], temp, sizeof(ExpEntryEx));
                     }
-                }
 
+                for (size_t i = 0; i < moves; ++i)
+                    work[i].set_next(i + 1 < moves);
+
+                //Copy to its final place and publish
+                if (!reserve_entries(moves) || (newKey && !_mainExp.reserve(1)))
+                    return false;
+
+                ExpEntryEx* block = _expData.back() + _chunkUsed;
+                _chunkUsed += moves;
+
+                memcpy((void*)block, work, moves * sizeof(ExpEntryEx));
+                _mainExp.set(key, block);
+
+                if (newKey && oldBlock)
+                    ++_overlaidCount;
+
+                return true;
+            }
+
+            bool _load(string fn)
+            {
+                ifstream in;
+                size_t inSize;
+                ExpReaders expReaders;
+                ExperienceReader* reader = open_experience_file(fn, in, inSize, expReaders);
                 if (!reader)
-                {
-                    sync_cout << "info string The file [" << fn << "] is not a valid experience file" << sync_endl;
                     return false;
-                }
 
                 if (reader->get_version() != Current::ExperienceVersion)
                     sync_cout << "info string Importing experience version (" << reader->get_version() << ") from file [" << fn << "]" << sync_endl;
 
-                //Allocate buffer for ExpEntryEx data
+                //Few variables to be used for statistical information
+                size_t prevPosCount = position_count();
+
+                //A version 3 file is probed in place unless it is merged with other experience data
+                size_t mappedCount = 0;
+                if (reader->get_version() == V3::ExperienceVersion && !_mapped.is_mapped() && !position_count())
+                {
+                    V3::ExperienceReader* v3Reader = static_cast<V3::ExperienceReader*>(reader);
+                    if (map(fn, v3Reader->file_header()))
+                    {
+                        v3Reader->skip_sorted();
+                        mappedCount = _mappedEntryCount;
+                    }
+                    else
+                        sync_cout << "info string Could not map experience file [" << fn << "], reading it instead" << sync_endl;
+                }
+
+                //Allocate buffer for the entries read from the file
                 size_t expCount = reader->entries_count();
-                ExpEntryEx* expData = (ExpEntryEx*)malloc(expCount * sizeof(ExpEntryEx));
-                if (!expData)
+                Current::ExpEntry* expData = (Current::ExpEntry*)malloc(expCount * sizeof(Current::ExpEntry));
+                if (!expData && expCount)
                 {
-                    sync_cout << "info string Failed to allocate " << expCount * sizeof(ExpEntryEx) << " bytes for experience data from file [" << fn << "]" << sync_endl;
+                    sync_cout << "info string Failed to allocate " << expCount * sizeof(Current::ExpEntry) << " bytes for experience data from file [" << fn << "]" << sync_endl;
                     return false;
                 }
 
-                //Few variables to be used for statistical information
-                size_t prevPosCount = _mainExp.size();
-
-                //Load experience entries
-                size_t duplicateMoves = 0;
-                ExpEntryEx *exp = expData;
-                for (size_t i = 0; i < expCount; ++i, ++exp)
+                //Read experience entries
+                for (size_t i = 0; i < expCount; ++i)
                 {
                     if (_abortLoading.load(memory_order_relaxed))
-                        break;
-
-                    //Prepare to read
-                    exp->next = nullptr;
+                    {
+                        free(expData);
+                        return false;
+                    }
 
-                    //Read
-                    if (!reader->read(in, exp))
+                    if (!reader->read(in, &expData[i]))
                     {
                         sync_cout << "info string Failed to read experience entry #" << i + 1 << " of " << expCount << sync_endl;
 
-                        delete expData;
+                        free(expData);
                         return false;
                     }
-
-                    //Merge
-                    if (!link_entry(exp))
-                        duplicateMoves++;
                 }
 
                 //Close input file
                 in.close();
 
-                //Add buffer to vector so that it will be released later
-                _expData.push_back(expData);
+                //Group the entries by position, duplicate moves stay in file order
+                vector<const Current::ExpEntry*> sorted(expCount);
+                for (size_t i = 0; i < expCount; ++i)
+                    sorted[i] = &expData[i];
+
+                stable_sort(sorted.begin(), sorted.end(), [](const Current::ExpEntry* a, const Current::ExpEntry* b) { return a->key < b->key; });
+
+                size_t posCount = 0;
+                for (size_t i = 0; i < expCount; ++i)
+                    posCount += !i || sorted[i]->key != sorted[i - 1]->key;
+
+                size_t duplicateMoves = 0;
+
+                //Link one position at a time
+                bool linked = true;
+                if (expCount)
+                {
+                    lock_guard<mutex> lg(_writerMutex);
+
+                    linked = reserve_entries(expCount) && _mainExp.reserve(posCount);
+                    for (size_t i = 0, j; linked && i < expCount && !_abortLoading.load(memory_order_relaxed); i = j)
+                    {
+                        for (j = i + 1; j < expCount && sorted[j]->key == sorted[i]->key; ++j) {}
+
+                        linked = link_entries(&sorted[i], j - i, duplicateMoves);
+                    }
+                }
+
+                free(expData);
+
+                if (!linked)
+                {
+                    sync_cout << "info string Failed to allocate memory for experience data from file [" << fn << "]" << sync_endl;
+                    return false;
+                }
 
                 //Stop if aborted
                 if (_abortLoading.load(memory_order_relaxed))
                     return false;
 
-                if (reader->get_version() != Current::ExperienceVersion)
+                //Upgrade the file, unless it was merged into other experience data
+                if (reader->get_version() != Current::ExperienceVersion && !prevPosCount)
                 {
                     sync_cout << "info string Upgrading experience file (" << fn << ") from version (" << reader->get_version() << ") to version (" << Current::ExperienceVersion << ")" << sync_endl;
                     save(fn, true, true);
@@ -625,11 +1069,12 @@ namespace Experience
                     return false;
 
                 //Show some statistics
+                expCount += mappedCount;
                 if (prevPosCount)
                 {
                     sync_cout
                         << "info string " << fn << " -> Total new moves: " << expCount
-                        << ". Total new positions: " << (_mainExp.size() - prevPosCount)
+                        << ". Total new positions: " << (position_count() - prevPosCount)
                         << ". Duplicate moves: " << duplicateMoves
                         << sync_endl;
                 }
@@ -637,7 +1082,7 @@ namespace Experience
                 {
                     sync_cout
                         << "info string " << fn << " -> Total moves: " << expCount
-                        << ". Total positions: " << _mainExp.size()
+                        << ". Total positions: " << position_count()
                         << ". Duplicate moves: " << duplicateMoves
                         << ". Fragmentation: " << setprecision(2) << fixed << 100.0 * (double)duplicateMoves / (double)expCount << "%"
                         << sync_endl;
@@ -656,22 +1101,32 @@ namespace Experience
                     return false;
                 }
 
-                //If this is a new file then we need to write the signature first
                 out.seekg(0, out.end);
                 size_t length = out.tellg();
                 out.seekg(0, out.beg);
 
-                if (length == 0)
+                //All the experience goes to a new file, save() moved the old one out of the way
+                if (saveAll && length != 0)
                 {
-                    out.seekp(0, out.beg);
+                    sync_cout << "info string Experience file [" << fn << "] is in the way of saving all the experience" << sync_endl;
+                    return false;
+                }
 
-                    out << Current::ExperienceSignature;
+                auto write_header = [&](const V3::FileHeader& header) -> bool
+                {
+                    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
                     if (!out)
                     {
-                        sync_cout << "info string Failed to write signature to experience file [" << fn << "]" << sync_endl;
+                        sync_cout << "info string Failed to write header to experience file [" << fn << "]" << sync_endl;
                         return false;
                     }
-                }
+
+                    return true;
+                };
+
+                //New entries go to the journal of an empty version 3 file if this is a new file
+                if (length == 0 && !saveAll && !write_header(V3::make_header(0, 0, 0)))
+                    return false;
 
                 //Reposition writing pointer to end of file
                 out.seekp(ios::end);
@@ -679,13 +1134,9 @@ namespace Experience
                 vector<char> writeBuffer;
                 writeBuffer.reserve(WriteBufferSize);
 
-                auto write_entry = [&](const Current::ExpEntry* exp, bool force) -> bool
+                auto write_data = [&](const void* data, size_t len, bool force) -> bool
                 {
-                    if (exp)
-                    {
-                        const char* data = reinterpret_cast<const char*>(exp);
-                        writeBuffer.insert(writeBuffer.end(), data, data + sizeof(Current::ExpEntry));
-                    }
+                    writeBuffer.insert(writeBuffer.end(), (const char*)data, (const char*)data + len);
 
                     bool success = true;
                     if (force || writeBuffer.size() >= WriteBufferSize)
@@ -700,57 +1151,126 @@ namespace Experience
                     return success;
                 };
 
+                //Entries are written with their count scaled down by 'scale'
+                auto write_entry = [&](const ExpEntryEx* exp, int scale, bool hasNext) -> bool
+                {
+                    alignas(ExpEntryEx) char data[sizeof(ExpEntryEx)];
+                    memcpy(data, (const void*)exp, sizeof(ExpEntryEx));
+
+                    ExpEntryEx* written = reinterpret_cast<ExpEntryEx*>(data);
+                    written->count = max(written->count / scale, 1);
+                    written->padding[1] = 0x00;
+                    written->set_next(hasNext);
+
+                    return write_data(data, sizeof(ExpEntryEx), false);
+                };
+
                 size_t allMoves = 0;
                 size_t allPositions = 0;
                 if (saveAll)
                 {
-                    for (ExpEntryEx* expEx : _newPvExp)
-                        link_entry(expEx);
+                    lock_guard<mutex> lg(_writerMutex);
+
+                    //Collect the positions, new experience is already linked into '_mainExp'
+                    //which replaces the mapped moves of the same position
+                    vector<pair<Key, const ExpEntryEx*>> positions;
+                    positions.reserve(position_count());
+
+                    _mainExp.for_each([&](Key k, const ExpEntryEx* exp) -> bool
+                    {
+                        positions.emplace_back(k, exp);
+                        return true;
+                    });
+
+                    for (const ExpEntryEx* exp = _mappedEntries; exp < _mappedEntries + _mappedEntryCount; ++exp)
+                    {
+                        if (exp->key && !_mainExp.probe(exp->key))
+                            positions.emplace_back(exp->key, exp);
+
+                        //Skip to the last move of the position
+                        while (exp->next())
+                            ++exp;
+                    }
 
-                    for (ExpEntryEx* expEx : _newMultiPvExp)
-                        link_entry(expEx);
+                    sort(positions.begin(), positions.end(), [](const pair<Key, const ExpEntryEx*>& a, const pair<Key, const ExpEntryEx*>& b) { return a.first < b.first; });
 
-                    ExpEntryEx* exp = nullptr;
-                    for (auto& x : _mainExp)
+                    //Count what is going to be saved
+                    for (const auto& pos : positions)
                     {
-                        allPositions++;
-                        exp = x.second;
+                        size_t moves = 0;
+                        for (const ExpEntryEx* exp = pos.second; exp; exp = exp->next())
+                            moves += exp->depth >= EXP_MIN_DEPTH;
+
+                        allMoves += moves;
+                        allPositions += moves != 0;
+                    }
+
+                    //Keep the index at most 3/4 full
+                    vector<V3::IndexBucket> index((allPositions + 2) / 3);
+                    if (!write_header(V3::make_header(allMoves, allPositions, index.size())))
+                        return false;
 
+                    //Save the entries and index the first move of each position
+                    size_t entry = 0;
+                    for (const auto& pos : positions)
+                    {
                         //Scale counts
                         uint16_t maxCount = numeric_limits<uint8_t>::min();
-                        ExpEntryEx* exp1 = exp;
-                        while (exp1)
+                        const ExpEntryEx* last = nullptr;
+                        for (const ExpEntryEx* exp = pos.second; exp; exp = exp->next())
                         {
-                            maxCount = max(maxCount, exp1->count);
-                            exp1 = exp1->next;
+                            maxCount = max(maxCount, exp->count);
+                            if (exp->depth >= EXP_MIN_DEPTH)
+                                last = exp;
                         }
 
-                        //Scale down
-                        uint16_t scale = 1 + maxCount / 128;
-                        exp1 = exp;
-                        while (exp1)
+                        if (!last)
+                            continue;
+
+                        int scale = 1 + maxCount / 128;
+
+                        size_t b = (size_t)mul_hi64(pos.first, index.size());
+                        V3::IndexSlot* slot = nullptr;
+                        while (!slot)
                         {
-                            exp1->count = max(exp1->count / scale, 1);
-                            exp1 = exp1->next;
+                            for (V3::IndexSlot& sl : index[b].slot)
+                                if (!sl.key)
+                                {
+                                    slot = &sl;
+                                    break;
+                                }
+
+                            if (++b == index.size())
+                                b = 0;
                         }
 
+                        slot->key = pos.first;
+                        slot->entry = entry;
+
                         //Save
-                        while (exp)
+                        for (const ExpEntryEx* exp = pos.second; exp; exp = exp->next())
                         {
-                            if (exp->depth >= EXP_MIN_DEPTH)
+                            if (exp->depth < EXP_MIN_DEPTH)
+                                continue;
+
+                            ++entry;
+                            if (!write_entry(exp, scale, exp != last))
                             {
-                                allMoves++;
-                                if (!write_entry(exp, false))
-                                {
-                                    sync_cout << "info string Failed to save experience entry to experience file [" << fn << "]" << sync_endl;
-                                    return false;
-                                }
+                                sync_cout << "info string Failed to save experience entry to experience file [" << fn << "]" << sync_endl;
+                                return false;
                             }
-
-                            exp = exp->next;
                         }
                     }
 
+                    //Save the index
+                    const char padding[sizeof(V3::IndexBucket)] = {};
+                    if (   !write_data(padding, V3::index_offset(allMoves) - sizeof(V3::FileHeader) - allMoves * sizeof(ExpEntryEx), false)
+                        || !write_data(index.data(), index.size() * sizeof(V3::IndexBucket), false))
+                    {
+                        sync_cout << "info string Failed to save experience index to experience file [" << fn << "]" << sync_endl;
+                        return false;
+                    }
+
                     sync_cout << "info string Saved " << allPositions << " position(s) and " << allMoves << " moves to experience file: " << fn << sync_endl;
                 }
                 else
@@ -762,7 +1282,7 @@ namespace Experience
                             if (exp->depth < EXP_MIN_DEPTH)
                                 continue;
 
-                            if (!write_entry(exp, false))
+                            if (!write_entry(exp, 1, false))
                             {
                                 sync_cout << "info string Failed to save experience entry to experience file [" << fn << "]" << sync_endl;
                                 return false;
@@ -774,180 +1294,563 @@ namespace Experience
                 }
 
                 //Flush buffer
-                write_entry(nullptr, true);
+                if (!write_data(nullptr, 0, true))
+                {
+                    sync_cout << "info string Failed to save experience data to experience file [" << fn << "]" << sync_endl;
+                    return false;
+                }
 
                 //Clear new moves
                 clear_new_exp();
 
-                return true;
+                return true;
+            }
+
+        public:
+            ExperienceData()
+            {
+                _chunkUsed = _chunkSize = 0;
+                _mappedEntries = nullptr;
+                _mappedIndex = nullptr;
+                _mappedEntryCount = _mappedBucketCount = _mappedPositionCount = _overlaidCount = 0;
+                _loading = false;
+                _abortLoading.store(false, memory_order_relaxed);
+                _loadingResult.store(false, memory_order_relaxed);
+                _loaderThread = nullptr;
+            }
+
+            ~ExperienceData()
+            {
+                clear();
+            }
+
+        public:
+
+            string filename() const
+            {
+                return _filename;
+            }
+
+            bool has_new_exp() const
+            {
+                return _newPvExp.size() || _newMultiPvExp.size();
+            }
+
+            bool load(string filename, bool synchronous)
+            {
+                //Make sure we are not already in the process of loading same/other experience file
+                wait_for_load_finished();
+
+                //Load requested experience file
+                _filename = filename;
+                _loadingResult.store(false, memory_order_relaxed);
+
+                //Block
+                {
+                    _loading = true;
+                    lock_guard<mutex> lg1(_loaderMutex);
+                    _loaderThread = new thread(thread([this, filename]()
+                        {
+                            //Load
+                            bool loadingResult = _load(filename);
+                            _loadingResult.store(loadingResult, memory_order_relaxed);
+
+                            //Copy pointer of loader thread so that we can
+                            //clear the variable now and and deleted later
+                            thread *t = _loaderThread;
+                            _loaderThread = nullptr;
+
+                            //Notify
+                            {
+                                lock_guard<mutex> lg2(_loaderMutex);
+                                _loading = false;
+                                _loadingCond.notify_one();
+                            }
+                            
+                            //Detach and delete loader thread
+                            t->detach();
+                            delete t;
+                        }));
+                }
+
+                return synchronous ? wait_for_load_finished() : true;
+            }
+
+            bool wait_for_load_finished()
+            {
+                unique_lock<mutex> ul(_loaderMutex);
+                _loadingCond.wait(ul, [&] { return !_loading; });
+                return loading_result();
+            }
+
+            bool loading_result() const
+            {
+                return _loadingResult.load(memory_order_relaxed);
+            }
+
+            void save(string fn, bool saveAll, bool ignoreLoadingCheck)
+            {
+                //Make sure we are not already in the process of loading same/other experience file
+                if(!ignoreLoadingCheck)
+                    wait_for_load_finished();
+
+                if (!has_new_exp() && (!saveAll || position_count() == 0))
+                    return;
+
+                //Step 1: Create backup only if 'saveAll' is 'true'
+                string expFilename = Utility::map_path(fn);
+                string backupExpFilename;
+                if (saveAll && Utility::file_exists(expFilename))
+                    backupExpFilename = backup_file(expFilename);
+
+                //Step 2: Save
+                if (!_save(fn, saveAll))
+                {
+                    //Step 2a: Restore backup in case of failure while saving
+                    restore_backup(expFilename, backupExpFilename);
+                }
+            }
+
+            const ExpEntryEx* probe(Key k) const
+            {
+                const ExpEntryEx* exp = _mainExp.probe(k);
+                return exp ? exp : probe_mapped(k);
+            }
+
+            void add_pv_experience(Key k, Move m, Value v, Depth d)
+            {
+                add_experience(_newPvExp, k, m, v, d);
+            }
+
+            void add_multipv_experience(Key k, Move m, Value v, Depth d)
+            {
+                add_experience(_newMultiPvExp, k, m, v, d);
+            }
+
+        private:
+            void add_experience(vector<ExpEntryEx*>& newExp, Key k, Move m, Value v, Depth d)
+            {
+                ExpEntryEx* exp = new ExpEntryEx(k, m, v, d, 1);
+
+                if (exp)
+                {
+                    newExp.emplace_back(exp);
+
+                    lock_guard<mutex> lg(_writerMutex);
+
+                    const Current::ExpEntry* e = exp;
+                    size_t duplicateMoves = 0;
+                    if (!link_entries(&e, 1, duplicateMoves))
+                        sync_cout << "info string Failed to allocate memory for experience data" << sync_endl;
+                }
+            }
+        };
+
+        ////////////////////////////////////////////////////////////////
+        // External sort used by defrag and merge
+        //
+        // The input entries are tagged with their position in the input and
+        // spread over partition files by key range. Position keys are evenly
+        // distributed, so every partition fits in the memory of one thread.
+        // The partitions are sorted on (key, move) and merged in parallel, then
+        // concatenated into a version 3 file. The home bucket of a key in the
+        // index grows with the key, so the index of the sorted entries can be
+        // written in order while they are copied.
+        ////////////////////////////////////////////////////////////////
+
+        //Memory used by the sort
+        constexpr size_t SortMemory = size_t(1024) * 1024 * 1024;
+
+        //An entry and its position in the input, which orders the merges of the same move
+        struct SortRecord
+        {
+            alignas(8) char data[sizeof(Current::ExpEntry)];
+            uint64_t seq;
+
+            ExpEntryEx& entry() { return *reinterpret_cast<ExpEntryEx*>(data); }
+            const ExpEntryEx& entry() const { return *reinterpret_cast<const ExpEntryEx*>(data); }
+        };
+
+        static_assert(sizeof(SortRecord) == 32);
+
+        //Writes the index of a version 3 file, positions must be added in key order
+        class IndexWriter
+        {
+        private:
+            static constexpr size_t SlotsPerBucket = 4;
+
+            fstream&              _out;
+            size_t                _bucketCount;
+            size_t                _nextSlot; //First slot that may be free
+            size_t                _bucket;   //Bucket held in '_current', the ones before are written
+            V3::IndexBucket       _current;
+            vector<V3::IndexSlot> _wrapped;  //Positions that continue at the first bucket
+
+            bool write_current()
+            {
+                _out.write(reinterpret_cast<const char*>(&_current), sizeof(_current));
+                memset((void*)&_current, 0, sizeof(_current));
+                ++_bucket;
+
+                return (bool)_out;
             }
 
         public:
-            ExperienceData()
+            IndexWriter(fstream& out, size_t bucketCount) : _out(out), _bucketCount(bucketCount), _nextSlot(0), _bucket(0), _current() {}
+
+            bool add(Key key, uint64_t entry)
             {
-                _loading = false;
-                _abortLoading.store(false, memory_order_relaxed);
-                _loadingResult.store(false, memory_order_relaxed);
-                _loaderThread = nullptr;
+                //Every slot from the home bucket up to '_nextSlot' is taken
+                _nextSlot = max(_nextSlot, (size_t)mul_hi64(key, _bucketCount) * SlotsPerBucket);
+                if (_nextSlot >= _bucketCount * SlotsPerBucket)
+                {
+                    _wrapped.push_back({ key, entry });
+                    return true;
+                }
+
+                while (_bucket < _nextSlot / SlotsPerBucket)
+                    if (!write_current())
+                        return false;
+
+                _current.slot[_nextSlot++ % SlotsPerBucket] = { key, entry };
+                return true;
             }
 
-            ~ExperienceData()
+            //Write the remaining buckets and put the wrapped positions into the first free slots
+            bool finish(size_t indexOffset)
             {
-                clear();
+                while (_bucket < _bucketCount)
+                    if (!write_current())
+                        return false;
+
+                size_t slot = 0;
+                for (const V3::IndexSlot& wrapped : _wrapped)
+                {
+                    V3::IndexSlot s;
+                    do
+                    {
+                        _out.seekg(indexOffset + slot++ * sizeof(V3::IndexSlot));
+                        if (!_out.read(reinterpret_cast<char*>(&s), sizeof(s)))
+                            return false;
+                    } while (s.key);
+
+                    _out.seekp(indexOffset + (slot - 1) * sizeof(V3::IndexSlot));
+                    _out.write(reinterpret_cast<const char*>(&wrapped), sizeof(wrapped));
+                }
+
+                return (bool)_out.flush();
             }
+        };
 
-        public:
+        //Merge the experience files 'inputs' into the version 3 file 'target',
+        //which may also be one of the inputs
+        bool sort_merge(const vector<string>& inputs, const string& target)
+        {
+            //The thread pool and the calling thread, see ThreadPool::parallel_for()
+            const size_t threadCount = Threads.size() + 1;
 
-            string filename() const
+            //Step 1: Count the entries
+            vector<string> files;
+            size_t totalCount = 0;
+            for (const string& fn : inputs)
             {
-                return _filename;
+                ifstream in;
+                size_t inSize;
+                ExpReaders expReaders;
+                ExperienceReader* reader = open_experience_file(fn, in, inSize, expReaders);
+                if (!reader)
+                    continue;
+
+                files.push_back(fn);
+                totalCount += reader->entries_count();
             }
 
-            bool has_new_exp() const
+            if (!totalCount)
+                return false;
+
+            //Each thread sorts one partition at a time in its share of the memory
+            const size_t partitionCount = max(threadCount, (totalCount * sizeof(SortRecord) * threadCount + SortMemory - 1) / SortMemory);
+            const size_t bufferRecords = max(SortMemory / sizeof(SortRecord) / partitionCount, size_t(256));
+
+            auto partition_name = [&](size_t p, const char* ext) { return target + ext + to_string(p); };
+
+            auto remove_partitions = [&]()
             {
-                return _newPvExp.size() || _newMultiPvExp.size();
-            }
+                for (size_t p = 0; p < partitionCount; ++p)
+                {
+                    remove(partition_name(p, ".part").c_str());
+                    remove(partition_name(p, ".sorted").c_str());
+                }
+            };
 
-            bool load(string filename, bool synchronous)
+            remove_partitions();
+
+            //Step 2: Partition
+            sync_cout << "info string Partitioning " << totalCount << " experience entries into " << partitionCount << " partitions" << sync_endl;
+
+            vector<vector<SortRecord>> buffers(partitionCount);
+            auto flush_partition = [&](size_t p) -> bool
             {
-                //Make sure we are not already in the process of loading same/other experience file
-                wait_for_load_finished();
+                ofstream out(partition_name(p, ".part"), ios::out | ios::binary | ios::app);
+                out.write(reinterpret_cast<const char*>(buffers[p].data()), buffers[p].size() * sizeof(SortRecord));
+                buffers[p].clear();
 
-                //Load requested experience file
-                _filename = filename;
-                _loadingResult.store(false, memory_order_relaxed);
+                return (bool)out;
+            };
 
-                //Block
+            uint64_t seq = 0;
+            for (const string& fn : files)
+            {
+                ifstream in;
+                size_t inSize;
+                ExpReaders expReaders;
+                ExperienceReader* reader = open_experience_file(fn, in, inSize, expReaders);
+                if (!reader)
                 {
-                    _loading = true;
-                    lock_guard<mutex> lg1(_loaderMutex);
-                    _loaderThread = new thread(thread([this, filename]()
-                        {
-                            //Load
-                            bool loadingResult = _load(filename);
-                            _loadingResult.store(loadingResult, memory_order_relaxed);
+                    remove_partitions();
+                    return false;
+                }
 
-                            //Copy pointer of loader thread so that we can
-                            //clear the variable now and and deleted later
-                            thread *t = _loaderThread;
-                            _loaderThread = nullptr;
+                SortRecord r;
+                for (size_t i = 0, n = reader->entries_count(); i < n; ++i)
+                {
+                    if (!reader->read(in, reinterpret_cast<Current::ExpEntry*>(r.data)))
+                    {
+                        sync_cout << "info string Failed to read experience entry #" << i + 1 << " of " << n << sync_endl;
+                        remove_partitions();
+                        return false;
+                    }
 
-                            //Notify
-                            {
-                                lock_guard<mutex> lg2(_loaderMutex);
-                                _loading = false;
-                                _loadingCond.notify_one();
-                            }
-                            
-                            //Detach and delete loader thread
-                            t->detach();
-                            delete t;
-                        }));
-                }
+                    r.seq = seq++;
 
-                return synchronous ? wait_for_load_finished() : true;
-            }
+                    size_t p = (size_t)mul_hi64(r.entry().key, partitionCount);
+                    buffers[p].push_back(r);
 
-            bool wait_for_load_finished()
-            {
-                unique_lock<mutex> ul(_loaderMutex);
-                _loadingCond.wait(ul, [&] { return !_loading; });
-                return loading_result();
+                    if (buffers[p].size() >= bufferRecords && !flush_partition(p))
+                    {
+                        sync_cout << "info string Failed to write experience partition: " << partition_name(p, ".part") << sync_endl;
+                        remove_partitions();
+                        return false;
+                    }
+                }
             }
 
-            bool loading_result() const
-            {
-                return _loadingResult.load(memory_order_relaxed);
-            }
+            for (size_t p = 0; p < partitionCount; ++p)
+                if (!buffers[p].empty() && !flush_partition(p))
+                {
+                    sync_cout << "info string Failed to write experience partition: " << partition_name(p, ".part") << sync_endl;
+                    remove_partitions();
+                    return false;
+                }
 
-            void save(string fn, bool saveAll, bool ignoreLoadingCheck)
+            buffers = vector<vector<SortRecord>>();
+
+            //Step 3: Sort and merge the partitions
+            atomic<size_t> positions(0), duplicateMoves(0), savedPositions(0), savedMoves(0);
+
+            auto sort_partition = [&](size_t p) -> bool
             {
-                //Make sure we are not already in the process of loading same/other experience file
-                if(!ignoreLoadingCheck)
-                    wait_for_load_finished();
+                vector<SortRecord> records;
+                ifstream in(partition_name(p, ".part"), ios::in | ios::binary | ios::ate);
+                if (in.is_open())
+                {
+                    records.resize(size_t(in.tellg()) / sizeof(SortRecord));
+                    in.seekg(0, ios::beg);
+                    if (!in.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(SortRecord)))
+                        return false;
 
-                if (!has_new_exp() && (!saveAll || _mainExp.size() == 0))
-                    return;
+                    in.close();
+                    remove(partition_name(p, ".part").c_str());
+                }
 
-                //Step 1: Create backup only if 'saveAll' is 'true'
-                string expFilename = Utility::map_path(fn);
-                string backupExpFilename;
-                if (saveAll && Utility::file_exists(expFilename))
+                sort(records.begin(), records.end(), [](const SortRecord& a, const SortRecord& b)
+                {
+                    const ExpEntryEx& ea = a.entry();
+                    const ExpEntryEx& eb = b.entry();
+
+                    return ea.key  != eb.key  ? ea.key  < eb.key
+                         : ea.move != eb.move ? ea.move < eb.move
+                                              : a.seq   < b.seq;
+                });
+
+                ofstream out(partition_name(p, ".sorted"), ios::out | ios::binary | ios::trunc);
+                vector<char> writeBuffer;
+                writeBuffer.reserve(WriteBufferSize);
+
+                vector<SortRecord> moves;
+                for (size_t i = 0, j; i < records.size() && out; i = j)
                 {
-                    backupExpFilename = expFilename + ".bak";
+                    //Merge the same moves in input order, each move keeps the position of its first entry
+                    const Key key = records[i].entry().key;
+                    moves.clear();
 
-                    //If backup file already exists then delete it
-                    if (Utility::file_exists(backupExpFilename))
+                    for (j = i; j < records.size() && records[j].entry().key == key; ++j)
                     {
-                        if (remove(backupExpFilename.c_str()) != 0)
-                        {
-                            sync_cout << "info string Could not deleted existing backup file: " << backupExpFilename << sync_endl;
+                        if (!key)
+                            continue; //Reserved for empty slots
 
-                            //Clear backup filename
-                            backupExpFilename.clear();
+                        if (!moves.empty() && moves.back().entry().move == records[j].entry().move)
+                        {
+                            moves.back().entry().merge(&records[j].entry());
+                            ++duplicateMoves;
                         }
+                        else
+                            moves.push_back(records[j]);
                     }
 
-                    //Rename current experience file
-                    if (!backupExpFilename.empty())
+                    if (moves.empty())
+                        continue;
+
+                    ++positions;
+
+                    //Best move first, as when loading
+                    sort(moves.begin(), moves.end(), [](const SortRecord& a, const SortRecord& b)
                     {
-                        if (rename(expFilename.c_str(), backupExpFilename.c_str()) != 0)
-                        {
-                            sync_cout << "info string Could not create backup of current experience file" << sync_endl;
+                        int c = a.entry().compare(&b.entry());
+                        return c ? c > 0 : a.seq < b.seq;
+                    });
+
+                    //Scale counts and keep the moves which are deep enough
+                    uint16_t maxCount = numeric_limits<uint8_t>::min();
+                    size_t last = moves.size();
+                    for (size_t k = 0; k < moves.size(); ++k)
+                    {
+                        maxCount = max(maxCount, moves[k].entry().count);
+                        if (moves[k].entry().depth >= EXP_MIN_DEPTH)
+                            last = k;
+                    }
 
-                            //Clear backup filename
-                            backupExpFilename.clear();
-                        }
+                    if (last == moves.size())
+                        continue;
+
+                    int scale = 1 + maxCount / 128;
+                    for (size_t k = 0; k <= last; ++k)
+                    {
+                        ExpEntryEx& exp = moves[k].entry();
+                        if (exp.depth < EXP_MIN_DEPTH)
+                            continue;
+
+                        exp.count = max(exp.count / scale, 1);
+                        exp.padding[1] = 0x00;
+                        exp.set_next(k != last);
+
+                        writeBuffer.insert(writeBuffer.end(), moves[k].data, moves[k].data + sizeof(moves[k].data));
+                        ++savedMoves;
                     }
-                }
 
-                //Step 2: Save
-                if (!_save(fn, saveAll))
-                {
-                    //Step 2a: Restore backup in case of failure while saving
-                    if (!backupExpFilename.empty())
+                    ++savedPositions;
+
+                    if (writeBuffer.size() >= WriteBufferSize)
                     {
-                        if (rename(backupExpFilename.c_str(), expFilename.c_str()) != 0)
-                        {
-                            sync_cout << "info string Could not restore backup experience file: " << backupExpFilename << sync_endl;
-                        }
+                        out.write(writeBuffer.data(), writeBuffer.size());
+                        writeBuffer.clear();
                     }
                 }
+
+                out.write(writeBuffer.data(), writeBuffer.size());
+                return (bool)out;
+            };
+
+            sync_cout << "info string Sorting experience partitions with " << min(threadCount, partitionCount) << " thread(s)" << sync_endl;
+
+            atomic<bool> failed(false);
+            Threads.parallel_for(partitionCount, [&](size_t p)
+            {
+                if (!failed && !sort_partition(p))
+                {
+                    sync_cout << "info string Failed to sort experience partition #" << p + 1 << " of " << partitionCount << sync_endl;
+                    failed = true;
+                }
+            });
+
+            if (failed)
+            {
+                remove_partitions();
+                return false;
             }
 
-            const ExpEntryEx* probe(Key k) const
+            sync_cout
+                << "info string " << target << " -> Total moves: " << totalCount
+                << ". Total positions: " << positions
+                << ". Duplicate moves: " << duplicateMoves
+                << ". Fragmentation: " << setprecision(2) << fixed << 100.0 * (double)duplicateMoves / (double)totalCount << "%"
+                << sync_endl;
+
+            //Step 4: Write the target file
+            string backupExpFilename;
+            if (Utility::file_exists(target) && (backupExpFilename = backup_file(target)).empty())
             {
-                ExpConstIterator itr = _mainExp.find(k);
-                if (itr == _mainExp.end())
-                    return nullptr;
+                remove_partitions();
+                return false;
+            }
 
-                assert(itr->second->key == k);
+            const V3::FileHeader header = V3::make_header(savedMoves, savedPositions, (savedPositions + 2) / 3);
+            const size_t indexOffset = V3::index_offset(header.entryCount);
 
-                return itr->second;
+            bool written;
+            {
+                ofstream create(target, ios::out | ios::binary | ios::trunc);
+                create.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                written = (bool)create;
             }
 
-            void add_pv_experience(Key k, Move m, Value v, Depth d)
+            if (written)
             {
-                ExpEntryEx* exp = new ExpEntryEx(k, m, v, d, 1);
+                fstream entriesOut(target, ios::in | ios::out | ios::binary);
+                fstream indexOut(target, ios::in | ios::out | ios::binary);
+                entriesOut.seekp(sizeof(header), ios::beg);
+                indexOut.seekp(indexOffset, ios::beg);
 
-                if (exp)
+                IndexWriter index(indexOut, header.bucketCount);
+                vector<char> chunk(ChunkEntries * sizeof(ExpEntryEx));
+                uint64_t entry = 0;
+                bool positionStart = true;
+
+                for (size_t p = 0; p < partitionCount && written; ++p)
                 {
-                    _newPvExp.emplace_back(exp);
-                    link_entry(exp);
+                    ifstream in(partition_name(p, ".sorted"), ios::in | ios::binary);
+                    while (written && in.is_open())
+                    {
+                        in.read(chunk.data(), chunk.size());
+                        size_t n = size_t(in.gcount()) / sizeof(ExpEntryEx);
+                        if (!n)
+                            break;
+
+                        const ExpEntryEx* exp = reinterpret_cast<const ExpEntryEx*>(chunk.data());
+                        for (size_t i = 0; i < n && written; ++i, ++entry)
+                        {
+                            if (positionStart)
+                                written = index.add(exp[i].key, entry);
+
+                            positionStart = !exp[i].next();
+                        }
+
+                        written = written && entriesOut.write(chunk.data(), n * sizeof(ExpEntryEx));
+                    }
                 }
+
+                const char padding[sizeof(V3::IndexBucket)] = {};
+                written =  written
+                        && entry == header.entryCount
+                        && entriesOut.write(padding, indexOffset - sizeof(header) - entry * sizeof(ExpEntryEx))
+                        && entriesOut.flush()
+                        && index.finish(indexOffset);
             }
 
-            void add_multipv_experience(Key k, Move m, Value v, Depth d)
-            {
-                ExpEntryEx* exp = new ExpEntryEx(k, m, v, d, 1);
+            remove_partitions();
 
-                if (exp)
-                {
-                    _newMultiPvExp.emplace_back(exp);
-                    link_entry(exp);
-                }
+            if (!written)
+            {
+                sync_cout << "info string Failed to write experience file: " << target << sync_endl;
+                remove(target.c_str());
+                restore_backup(target, backupExpFilename);
+                return false;
             }
-        };
+
+            sync_cout << "info string Saved " << savedPositions << " position(s) and " << savedMoves << " moves to experience file: " << target << sync_endl;
+
+            return true;
+        }
 
         ExperienceData*currentExperience = nullptr;
         bool experienceEnabled = true;
@@ -1018,6 +1921,23 @@ namespace Experience
         currentExperience->wait_for_load_finished();
     }
 
+    //Open an experience file for appending new entries to its journal. A new
+    //file starts with the header of an empty version 3 file
+    bool open_journal(fstream& out, const string& filename)
+    {
+        out.open(filename, ios::out | ios::binary | ios::app | ios::ate);
+        if (!out.is_open())
+            return false;
+
+        if (out.tellp() == 0)
+        {
+            V3::FileHeader header = V3::make_header(0, 0, 0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+
+        return (bool)out;
+    }
+
     //Defrag command:
     //Format:  defrag [filename]
     //Example: defrag C:\Path to\Experience\file.exp
@@ -1045,13 +1965,8 @@ namespace Experience
         //Map filename
         filename = Utility::map_path(filename);
 
-        //Load
-        ExperienceData exp;
-        if (!exp.load(filename, true))
-            return;
-
-        //Save
-        exp.save(filename, true, false);
+        //Sort, merge and save
+        sort_merge({ filename }, filename);
     }
 
     //Merge command:
@@ -1092,12 +2007,8 @@ namespace Experience
 
         cout << "\nTarget file: " << targetFilename << "\n" << sync_endl;
 
-        //Step 4: Load and merge
-        ExperienceData exp;
-        for (const string& fn : filenames)
-            exp.load(fn, true);
-
-        exp.save(targetFilename, true, false);
+        //Step 4: Sort, merge and save
+        sort_merge(filenames, targetFilename);
     }
 
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1145,8 +2056,8 @@ namespace Experience
                                                           << endl << sync_endl;
 
         //////////////////////////////////////////////////////////////////
-        //Conversion information
-        struct GLOBAL_COMPACT_PGN_CONVERSION_DATA
+        //Conversion statistics
+        struct COMPACT_PGN_CONVERSION_STATS
         {
             //Game statistics
             size_t numGames = 0;
@@ -1156,14 +2067,34 @@ namespace Experience
             //Move statistics
             size_t numMovesWithScores = 0;
             size_t numMovesWithScoresIgnored = 0;
-            size_t numMovesWithoutScores = 0;                        
+            size_t numMovesWithoutScores = 0;
 
             //WBD statistics
             size_t wbd[COLOR_NB + 1] = { 0, 0, 0 };
 
+            void add(const COMPACT_PGN_CONVERSION_STATS& stats)
+            {
+                numGames += stats.numGames;
+                numGamesWithErrors += stats.numGamesWithErrors;
+                numGamesIgnored += stats.numGamesIgnored;
+
+                numMovesWithScores += stats.numMovesWithScores;
+                numMovesWithScoresIgnored += stats.numMovesWithScoresIgnored;
+                numMovesWithoutScores += stats.numMovesWithoutScores;
+
+                for (int c = WHITE; c <= COLOR_NB; ++c)
+                    wbd[c] += stats.wbd[c];
+            }
+        };
+
+        //////////////////////////////////////////////////////////////////
+        //Conversion information
+        struct GLOBAL_COMPACT_PGN_CONVERSION_DATA : COMPACT_PGN_CONVERSION_STATS
+        {
             //Input stream
             fstream inputStream;
             size_t inputStreamSize = 0;
+            size_t inputStreamPos = 0;
 
             //Output stream
             fstream outputStream;
@@ -1194,7 +2125,19 @@ namespace Experience
                 drawDetected = false;
                 memset((void*)&resultWeight, 0, sizeof(resultWeight));
             }
-        }gameData;
+        };
+
+        //////////////////////////////////////////////////////////////////
+        //Shard information: consecutive games converted by one thread. The
+        //experience entries of a shard are appended to the output in input
+        //order, so the output does not depend on the number of threads
+        struct COMPACT_PGN_SHARD_DATA : COMPACT_PGN_CONVERSION_STATS
+        {
+            vector<string> games;
+            vector<char> buffer;
+
+            COMPACT_PGN_CONVERSION_DATA gameData;
+        };
 
         //////////////////////////////////////////////////////////////////////////
         //Input stream
@@ -1210,8 +2153,7 @@ namespace Experience
 
         //////////////////////////////////////////////////////////////////////////
         //Output stream
-        globalConversionData.outputStream.open(outputPath, ios::out | ios::binary | ios::app | ios::ate);
-        if (!globalConversionData.outputStream.is_open())
+        if (!open_journal(globalConversionData.outputStream, outputPath))
         {
             sync_cout << "Could not open <" << outputPath << "> for writing" << sync_endl;
             return;
@@ -1219,13 +2161,6 @@ namespace Experience
 
         globalConversionData.outputStreamBase = globalConversionData.outputStream.tellp();
 
-        //If the output file is a new file, then we need to write the signature
-        if (globalConversionData.outputStreamBase == 0)
-        {
-            globalConversionData.outputStream << Current::ExperienceSignature.c_str();
-            globalConversionData.outputStreamBase = globalConversionData.outputStream.tellp();
-        }
-
         //////////////////////////////////////////////////////////////////////////
         //Buffer
         globalConversionData.buffer.reserve(WriteBufferSize);
@@ -1240,14 +2175,9 @@ namespace Experience
                 globalConversionData.buffer.clear();
 
                 size_t numMoves = globalConversionData.numMovesWithScores + globalConversionData.numMovesWithScoresIgnored + globalConversionData.numMovesWithoutScores;
-                size_t inputStreamPos = globalConversionData.inputStream.tellg();
-
-                //Fix for end-of-input stream value of -1!
-                if (inputStreamPos == (size_t)-1)
-                    inputStreamPos = globalConversionData.inputStreamSize;
 
                 sync_cout
-                    << fixed << setprecision(2) << setw(6) << setfill(' ') << ((double)inputStreamPos * 100.0 / (double)globalConversionData.inputStreamSize) << "% ->"
+                    << fixed << setprecision(2) << setw(6) << setfill(' ') << ((double)globalConversionData.inputStreamPos * 100.0 / (double)globalConversionData.inputStreamSize) << "% ->"
                     << " Games: " << globalConversionData.numGames << " (errors: " << globalConversionData.numGamesWithErrors << "),"
                     << " WBD: " << globalConversionData.wbd[WHITE] << "/" << globalConversionData.wbd[BLACK] << "/" << globalConversionData.wbd[COLOR_NB] << ","
                     << " Moves: " << numMoves << " (" << globalConversionData.numMovesWithScores << " with scores, " << globalConversionData.numMovesWithoutScores << " without scores, " << globalConversionData.numMovesWithScoresIgnored << " ignored)."
@@ -1272,7 +2202,7 @@ namespace Experience
 
         //////////////////////////////////////////////////////////////////
         //Conversion routine
-        auto convert_compact_pgn_to_exp = [&](const string &compactPgn) -> bool
+        auto convert_compact_pgn_to_exp = [&](const string &compactPgn, COMPACT_PGN_SHARD_DATA& shard) -> bool
         {
             constexpr Value GOOD_SCORE = PawnValueEg * 3;
             constexpr Value OK_SCORE = GOOD_SCORE / 2;
@@ -1282,17 +2212,18 @@ namespace Experience
             constexpr int MIN_PLY_PER_GAME = 16;
 
             //Clear current game data
+            COMPACT_PGN_CONVERSION_DATA& gameData = shard.gameData;
             gameData.clear();
 
             //Increment games counter
-            ++globalConversionData.numGames;
+            ++shard.numGames;
 
             //Split compact PGN into its main three parts
             vector<string> tokens = tokenize(compactPgn, ',');
 
             if (tokens.size() < 3)
             {
-                ++globalConversionData.numGamesWithErrors;
+                ++shard.numGamesWithErrors;
                 return false;
             }
 
@@ -1336,7 +2267,7 @@ namespace Experience
 
                 if (tok.size() >= 4)
                 {
-                    ++globalConversionData.numGamesWithErrors;
+                    ++shard.numGamesWithErrors;
                     return false;
                 }
 
@@ -1347,7 +2278,7 @@ namespace Experience
                 //Check if move is empty
                 if (_move.empty())
                 {
-                    ++globalConversionData.numGamesWithErrors;
+                    ++shard.numGamesWithErrors;
                     return false;
                 }
 
@@ -1355,7 +2286,7 @@ namespace Experience
                 Move move = UCI::to_move(gameData.pos, _move);
                 if (move == MOVE_NONE)
                 {
-                    ++globalConversionData.numGamesWithErrors;
+                    ++shard.numGamesWithErrors;
                     return false;
                 }
 
@@ -1366,7 +2297,7 @@ namespace Experience
                 {
                     if (depth >= minDepth && depth <= maxDepth && abs(score) <= maxValue)
                     {
-                        ++globalConversionData.numMovesWithScores;
+                        ++shard.numMovesWithScores;
 
                         //Assign to temporary experience
                         tempExp.key = gameData.pos.key();
@@ -1380,7 +2311,7 @@ namespace Experience
                     }
                     else
                     {
-                        ++globalConversionData.numMovesWithScoresIgnored;
+                        ++shard.numMovesWithScoresIgnored;
                     }
 
                     //////////////////////////////////////////////////////////////////
@@ -1393,13 +2324,13 @@ namespace Experience
                             gameData.detectedWinnerColor = winnerColorBasedOnThisMove;
                             if (gameData.detectedWinnerColor != winnerColor)
                             {
-                                ++globalConversionData.numGamesIgnored;
+                                ++shard.numGamesIgnored;
                                 return false;
                             }
                         }
                         else if (gameData.detectedWinnerColor != winnerColorBasedOnThisMove)
                         {
-                            ++globalConversionData.numGamesIgnored;
+                            ++shard.numGamesIgnored;
                             return false;
                         }
                     }
@@ -1436,7 +2367,7 @@ namespace Experience
                 }
                 else
                 {
-                    ++globalConversionData.numMovesWithoutScores;
+                    ++shard.numMovesWithoutScores;
                 }
 
                 //Do the move
@@ -1469,7 +2400,7 @@ namespace Experience
                 //If draw is detected but game result isn't draw then reject the game
                 if (gameData.drawDetected && gameData.detectedWinnerColor != COLOR_NB)
                 {
-                    ++globalConversionData.numGamesIgnored;
+                    ++shard.numGamesIgnored;
                     return false;
                 }
             }
@@ -1477,7 +2408,7 @@ namespace Experience
             //Does the game have enough moves?
             if (gamePly < MIN_PLY_PER_GAME)
             {
-                ++globalConversionData.numGamesIgnored;
+                ++shard.numGamesIgnored;
                 return false;
             }
 
@@ -1496,35 +2427,105 @@ namespace Experience
                 || (winnerColor != COLOR_NB && gameData.resultWeight[winnerColor] < MIN_WEIGHT_FOR_WIN)
                 || (winnerColor == COLOR_NB && !gameData.drawDetected && gameData.resultWeight[COLOR_NB] < MIN_WEIGHT_FOR_DRAW))
             {
-                ++globalConversionData.numGamesIgnored;
+                ++shard.numGamesIgnored;
                 return false;
             }
 
             //Update WBD stats
-            ++globalConversionData.wbd[winnerColor];
+            ++shard.wbd[winnerColor];
 
-            //Copy to global buffer
-            globalConversionData.buffer.insert(globalConversionData.buffer.end(), tempBuffer.begin(), tempBuffer.end());
+            //Copy to shard buffer
+            shard.buffer.insert(shard.buffer.end(), tempBuffer.begin(), tempBuffer.end());
 
             return true;
         };
 
         //////////////////////////////////////////////////////////////////
-        //Loop
-        string line;
-        while (getline(globalConversionData.inputStream, line))
+        //Convert a shard
+        auto convert_shard = [&](COMPACT_PGN_SHARD_DATA& shard)
+        {
+            for (string& line : shard.games)
+            {
+                line = line.substr(1, line.size() - 2);
+                convert_compact_pgn_to_exp(line, shard);
+            }
+        };
+
+        //////////////////////////////////////////////////////////////////
+        //Read the games of the next batch, returns the number of games read
+        constexpr size_t GamesPerShard = 4096;
+
+        auto read_games = [&](vector<COMPACT_PGN_SHARD_DATA>& shards) -> size_t
+        {
+            size_t numGames = 0;
+            string line;
+            for (COMPACT_PGN_SHARD_DATA& shard : shards)
+            {
+                shard.games.clear();
+                while (shard.games.size() < GamesPerShard && getline(globalConversionData.inputStream, line))
+                {
+                    //Skip empty lines and lines which aren't games
+                    if (line.empty() || line.front() != '{' || line.back() != '}')
+                        continue;
+
+                    shard.games.push_back(std::move(line));
+                }
+
+                numGames += shard.games.size();
+            }
+
+            return numGames;
+        };
+
+        auto input_position = [&]() -> size_t
+        {
+            size_t inputStreamPos = globalConversionData.inputStream.tellg();
+
+            //Fix for end-of-input stream value of -1!
+            return inputStreamPos == (size_t)-1 ? globalConversionData.inputStreamSize : inputStreamPos;
+        };
+
+        //////////////////////////////////////////////////////////////////
+        //Loop: the thread pool converts one batch of games, a shard per
+        //worker, while one more task reads the next batch
+        const size_t numThreads = Threads.size() + 1;
+        vector<COMPACT_PGN_SHARD_DATA> shards[2] = { vector<COMPACT_PGN_SHARD_DATA>(numThreads), vector<COMPACT_PGN_SHARD_DATA>(numThreads) };
+
+        size_t batch = 0;
+        size_t batchGames = read_games(shards[batch]);
+        size_t batchEnd = input_position();
+
+        while (batchGames)
         {
-            //Skip empty lines
-            if (line.empty())
-                continue;
+            //Task 0 reads the next batch, the others convert a shard each
+            size_t nextBatchGames = 0, nextBatchEnd = 0;
+            Threads.parallel_for(numThreads + 1, [&](size_t t)
+            {
+                if (t)
+                    convert_shard(shards[batch][t - 1]);
+                else
+                {
+                    nextBatchGames = read_games(shards[batch ^ 1]);
+                    nextBatchEnd = input_position();
+                }
+            });
+
+            //Commit the converted batch in input order
+            for (COMPACT_PGN_SHARD_DATA& shard : shards[batch])
+            {
+                globalConversionData.add(shard);
+                globalConversionData.buffer.insert(globalConversionData.buffer.end(), shard.buffer.begin(), shard.buffer.end());
 
-            if (line.front() != '{' || line.back() != '}')
-                continue;
+                shard.buffer.clear();
+                static_cast<COMPACT_PGN_CONVERSION_STATS&>(shard) = COMPACT_PGN_CONVERSION_STATS();
+            }
 
-            line = line.substr(1, line.size() - 2);
+            globalConversionData.inputStreamPos = batchEnd;
+            write_data(false);
 
-            if (convert_compact_pgn_to_exp(line))
-                write_data(false);
+            batchGames = nextBatchGames;
+            batchEnd = nextBatchEnd;
+            batch ^= 1;
         }
 
         //Final commit
@@ -1539,12 +2540,7 @@ namespace Experience
 
             sync_cout << "Conversion complete" << endl << endl << "Defragmenting: " << outputPath << sync_endl;
 
-            ExperienceData exp;
-            if (!exp.load(outputPath, true))
-                return;
-
-            //Save
-            exp.save(outputPath, true, false);
+            sort_merge({ outputPath }, outputPath);
         }
     }
 
@@ -1569,7 +2565,7 @@ namespace Experience
         while (temp)
         {
             quality.emplace_back(temp, temp->quality(pos, evalImportance).first);
-            temp = temp->next;
+            temp = temp->next();
         }
 
         //Sort experience moves based on quality
@@ -1602,8 +2598,6 @@ namespace Experience
             }
 
             cout << endl;
-
-            expEx = expEx->next;
         }
 
         cout << sync_endl;
@@ -19,6 +19,9 @@
 #ifndef __EXPERIENCE_H__
 #define __EXPERIENCE_H__
 
+#include <fstream>
+#include <string>
+
 #include "types.h"
 
 using namespace std;
@@ -149,54 +152,60 @@ namespace Experience
         static_assert(sizeof(ExpEntry) == 24);
     }
 
-    namespace Current = V2;
+    namespace V3
+    {
+        //Same entries as V2, the file adds a position index (see experience.cpp)
+        using ExpEntry = V2::ExpEntry;
+    }
+
+    namespace Current = V3;
 
     //Experience structure
+    //The moves of a position are stored next to each other, best move first.
+    //The first padding byte is set on every entry that is followed by another
+    //move of the same position, so that walking the moves is a linear scan
     struct ExpEntryEx : public Current::ExpEntry
     {
-        ExpEntryEx* next = nullptr;
-
         ExpEntryEx() = delete;
         ExpEntryEx(const ExpEntryEx& exp) = delete;
         ExpEntryEx& operator =(const ExpEntryEx& exp) = delete;
 
         explicit ExpEntryEx(Stockfish::Key k, Stockfish::Move m, Stockfish::Value v, Stockfish::Depth d, uint8_t c) : Current::ExpEntry(k, m, v, d, c) {}
 
-        ExpEntryEx* find(Stockfish::Move m) const
+        const ExpEntryEx* next() const
+        {
+            return padding[0] ? this + 1 : nullptr;
+        }
+
+        void set_next(bool hasNext)
+        {
+            padding[0] = hasNext ? 0x01 : 0x00;
+        }
+
+        const ExpEntryEx* find(Stockfish::Move m) const
         {
-            ExpEntryEx* exp = const_cast<ExpEntryEx*>(this);
+            const ExpEntryEx* exp = this;
             do
             {
                 if (exp->move == m)
                     return exp;
 
-                exp = exp->next;
+                exp = exp->next();
             } while (exp);
 
             return nullptr;
         }
 
-        ExpEntryEx* find(Stockfish::Move mv, Stockfish::Depth minDepth) const
+        const ExpEntryEx* find(Stockfish::Move mv, Stockfish::Depth minDepth) const
         {
-            ExpEntryEx* temp = const_cast<ExpEntryEx*>(this);
-            do
-            {
-                if ((Stockfish::Move)temp->move == mv)
-                {
-                    if (temp->depth < minDepth)
-                        temp = nullptr;
-
-                    break;
-                }
-
-                temp = temp->next;
-            } while (temp);
-
-            return temp;
+            const ExpEntryEx* temp = find(mv);
+            return temp && temp->depth >= minDepth ? temp : nullptr;
         }
 
         std::pair<int, bool> quality(Stockfish::Position& pos, int evalImportance) const;
     };
+
+    static_assert(sizeof(ExpEntryEx) == sizeof(Current::ExpEntry));
 }
 
 namespace Experience
@@ -209,6 +218,8 @@ namespace Experience
 
     void wait_for_loading_finished();
 
+    bool open_journal(std::fstream& out, const std::string& filename);
+
     const ExpEntryEx* probe(Stockfish::Key k);
 
     void defrag(int argc, char* argv[]);
@@ -40,6 +40,8 @@ typedef bool(*fun3_t)(HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 }
 #endif
 
+#include <array>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iomanip>
@@ -65,6 +67,18 @@ typedef bool(*fun3_t)(HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 #include <sys/mman.h>
 #endif
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 #if defined(__APPLE__) || defined(__ANDROID__) || defined(__OpenBSD__) || (defined(__GLIBCXX__) && !defined(_GLIBCXX_HAVE_ALIGNED_ALLOC) && !defined(_WIN32)) || defined(__e2k__)
 #define POSIXALIGNEDALLOC
 #include <stdlib.h>
@@ -337,7 +351,9 @@ std::string compiler_info() {
 
   compiler += "\nCompilation settings include: ";
   compiler += (Is64Bit ? " 64bit" : " 32bit");
-  #if defined(USE_VNNI)
+  #if defined(USE_AVXVNNI)
+    compiler += " AVXVNNI";
+  #elif defined(USE_VNNI)
     compiler += " VNNI";
   #endif
   #if defined(USE_AVX512)
@@ -1054,6 +1070,54 @@ namespace SysInfo
     }
 }
 
+/// crc32() computes the standard CRC-32 (as used by zlib) of a buffer, or
+/// continues the one given in 'crc'. It processes 8 bytes per step using the
+/// slicing-by-8 tables, which are built on first use.
+
+uint32_t crc32(const void* data, size_t len, uint32_t crc) {
+
+  static const auto Tables = [] {
+      std::vector<std::array<uint32_t, 256>> t(8);
+
+      for (uint32_t i = 0; i < 256; ++i)
+      {
+          uint32_t c = i;
+          for (int k = 0; k < 8; ++k)
+              c = (c >> 1) ^ (0xEDB88320 & (0 - (c & 1)));
+          t[0][i] = c;
+      }
+
+      for (uint32_t i = 0; i < 256; ++i)
+          for (int s = 1; s < 8; ++s)
+              t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+
+      return t;
+  }();
+
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+
+  if (IsLittleEndian)
+      for ( ; len >= 8; len -= 8, p += 8)
+      {
+          uint32_t lo, hi;
+          std::memcpy(&lo, p, 4);
+          std::memcpy(&hi, p + 4, 4);
+          lo ^= crc;
+
+          crc =  Tables[7][ lo        & 0xFF] ^ Tables[6][(lo >>  8) & 0xFF]
+               ^ Tables[5][(lo >> 16) & 0xFF] ^ Tables[4][ lo >> 24        ]
+               ^ Tables[3][ hi        & 0xFF] ^ Tables[2][(hi >>  8) & 0xFF]
+               ^ Tables[1][(hi >> 16) & 0xFF] ^ Tables[0][ hi >> 24        ];
+      }
+
+  while (len--)
+      crc = (crc >> 8) ^ Tables[0][(crc ^ *p++) & 0xFF];
+
+  return ~crc;
+}
+
+
 /// Debug functions used mainly to collect run-time statistics
 static std::atomic<int64_t> hits[2], means[2];
 
@@ -1263,11 +1327,320 @@ void aligned_large_pages_free(void *mem) {
 #endif
 
 
+/// MemoryMappedFile::map() maps the whole file 'fname' into memory, shared with
+/// the file itself and with every other process mapping the same file. Large
+/// pages are requested where the OS supports them for file backed memory. The
+/// file can still be appended to, renamed or deleted while it is mapped.
+
+bool MemoryMappedFile::map(const std::string& fname, bool writable) {
+
+  unmap();
+
+#if defined(_WIN32)
+
+  HANDLE fh = CreateFileA(fname.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0),
+                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                          FILE_FLAG_RANDOM_ACCESS, nullptr);
+  if (fh == INVALID_HANDLE_VALUE)
+      return false;
+
+  LARGE_INTEGER fsize;
+  if (!GetFileSizeEx(fh, &fsize) || fsize.QuadPart == 0)
+  {
+      CloseHandle(fh);
+      return false;
+  }
+
+  HANDLE mh = CreateFileMapping(fh, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                fsize.HighPart, fsize.LowPart, nullptr);
+  if (!mh)
+  {
+      CloseHandle(fh);
+      return false;
+  }
+
+  void* addr = MapViewOfFile(mh, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+  if (!addr)
+  {
+      CloseHandle(mh);
+      CloseHandle(fh);
+      return false;
+  }
+
+  fileHandle = fh;
+  mapHandle = mh;
+  mapSize = size_t(fsize.QuadPart);
+
+#else
+
+  int fdesc = ::open(fname.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (fdesc == -1)
+      return false;
+
+  struct stat statbuf;
+  if (fstat(fdesc, &statbuf) || statbuf.st_size == 0)
+  {
+      ::close(fdesc);
+      return false;
+  }
+
+  void* addr = mmap(nullptr, statbuf.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+                    MAP_SHARED, fdesc, 0);
+  if (addr == MAP_FAILED)
+  {
+      ::close(fdesc);
+      return false;
+  }
+
+#if defined(MADV_HUGEPAGE)
+  madvise(addr, statbuf.st_size, MADV_HUGEPAGE);
+#endif
+#if defined(MADV_RANDOM)
+  madvise(addr, statbuf.st_size, MADV_RANDOM);
+#endif
+
+  fd = fdesc;
+  mapSize = size_t(statbuf.st_size);
+
+#endif
+
+  mem = static_cast<char*>(addr);
+  fileName = fname;
+  return true;
+}
+
+
+/// MemoryMappedFile::unmap() releases the mapping. Modified pages are written
+/// back by the OS in any case, unmap() does not wait for it.
+
+void MemoryMappedFile::unmap() {
+
+  if (!mem)
+      return;
+
+#if defined(_WIN32)
+  UnmapViewOfFile(mem);
+  CloseHandle(mapHandle);
+  CloseHandle(fileHandle);
+  mapHandle = fileHandle = nullptr;
+#else
+  munmap(mem, mapSize);
+  ::close(fd);
+  fd = -1;
+#endif
+
+  mem = nullptr;
+  mapSize = 0;
+  fileName.clear();
+}
+
+
+/// MemoryMappedFile::flush() synchronously writes the modified pages in the
+/// given byte range back to the file. Clean pages are skipped by the OS.
+
+bool MemoryMappedFile::flush(size_t offset, size_t len) const {
+
+  if (!mem || offset >= mapSize)
+      return false;
+
+  len = std::min(len, mapSize - offset);
+
+#if defined(_WIN32)
+  return   FlushViewOfFile(mem + offset, len)
+        && FlushFileBuffers(fileHandle);
+#else
+  // msync() requires a page aligned start address
+  const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+  const size_t start = offset / pageSize * pageSize;
+  return msync(mem + start, len + offset - start, MS_SYNC) == 0;
+#endif
+}
+
+
+/// MemoryMappedFile::will_need() asks the OS to read the whole mapping in now,
+/// instead of faulting its pages in one by one on first access.
+
+void MemoryMappedFile::will_need() const {
+
+#if defined(MADV_WILLNEED)
+  if (mem)
+      madvise(mem, mapSize, MADV_WILLNEED);
+#endif
+}
+
+
 namespace WinProcGroup {
 
-#ifndef _WIN32
+#if defined(__linux__)
+
+namespace {
+
+  struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+  };
+
+  // parse_list() parses a sysfs list of cpus or nodes, like "0-31,64-95"
+  std::vector<int> parse_list(const string& s) {
 
+    std::vector<int> v;
+    std::istringstream ss(s);
+    string range;
+
+    while (std::getline(ss, range, ','))
+    {
+        int first, last;
+        char dash;
+        std::istringstream rs(range);
+
+        if (!(rs >> first))
+            continue;
+
+        last = (rs >> dash >> last) ? last : first;
+
+        for (int i = first; i <= last; ++i)
+            v.push_back(i);
+    }
+
+    return v;
+  }
+
+  // Topology holds the online NUMA nodes with at least one cpu the process may
+  // run on, read once from sysfs and intersected with the affinity mask the
+  // process was started with. The nodes are empty if the information is not
+  // available. 'restricted' is set when that mask excludes some cpus of the
+  // nodes, e.g. under taskset or in a cpuset, and threads are then not bound.
+  struct Topology {
+    std::vector<NumaNode> nodes;
+    bool restricted = false;
+  };
+
+  const Topology& topology() {
+
+    static const Topology topo = [] {
+
+        Topology t;
+        string line;
+        std::ifstream online("/sys/devices/system/node/online");
+        cpu_set_t allowed;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return t;
+
+        if (std::getline(online, line))
+            for (int id : parse_list(line))
+            {
+                std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+                string cpus;
+                NumaNode node = { id, {} };
+
+                if (std::getline(cpulist, cpus))
+                    for (int cpu : parse_list(cpus))
+                    {
+                        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                            node.cpus.push_back(cpu);
+                        else
+                            t.restricted = true;
+                    }
+
+                if (!node.cpus.empty())
+                    t.nodes.push_back(node);
+            }
+
+        return t;
+    }();
+
+    return topo;
+  }
+
+  const std::vector<NumaNode>& numa_nodes() { return topology().nodes; }
+
+  // best_node() fills the nodes one after the other, as best_group() does on
+  // Windows, and returns -1 when there are more threads than cpus.
+  int best_node(size_t idx) {
+
+    size_t cpus = 0;
+
+    for (size_t n = 0; n < numa_nodes().size(); ++n)
+        if (idx < (cpus += numa_nodes()[n].cpus.size()))
+            return int(n);
+
+    return -1;
+  }
+
+} // namespace
+
+size_t node_count() { return std::max(size_t(1), numa_nodes().size()); }
+
+
+/// bindThisThreadToNode() restricts the current thread to the cpus of the
+/// given node, so that the memory it touches first is allocated there. The
+/// affinity is left alone if the process was started with a restricted one.
+
+void bindThisThreadToNode(size_t node) {
+
+  if (numa_nodes().size() < 2 || node >= numa_nodes().size() || topology().restricted)
+      return;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  for (int cpu : numa_nodes()[node].cpus)
+      if (cpu < CPU_SETSIZE)
+          CPU_SET(cpu, &set);
+
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+
+void bindThisThread(size_t idx) {
+
+  if (numa_nodes().size() < 2)
+      return;
+
+  int node = best_node(idx);
+
+  if (node != -1)
+      bindThisThreadToNode(size_t(node));
+}
+
+
+/// interleave() asks the kernel to spread the pages of the given memory, page
+/// aligned, round-robin over all the nodes. Pages already touched are moved.
+
+bool interleave(void* mem, size_t size) {
+
+#if defined(SYS_mbind)
+  constexpr int MPOL_INTERLEAVE_ = 3; // From linux/mempolicy.h
+  constexpr unsigned MPOL_MF_MOVE_ = 2;
+  constexpr size_t MaxNodes = 1024;
+
+  if (numa_nodes().size() < 2)
+      return false;
+
+  unsigned long mask[MaxNodes / (8 * sizeof(unsigned long))] = {};
+
+  for (const NumaNode& n : numa_nodes())
+      if (size_t(n.id) < MaxNodes)
+          mask[n.id / (8 * sizeof(unsigned long))] |= 1UL << (n.id % (8 * sizeof(unsigned long)));
+
+  const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+  size = (size + pageSize - 1) / pageSize * pageSize;
+
+  // The kernel uses maxnode - 1 bits of the mask
+  return syscall(SYS_mbind, mem, size, MPOL_INTERLEAVE_, mask, MaxNodes + 1, MPOL_MF_MOVE_) == 0;
+#else
+  (void)mem, (void)size;
+  return false;
+#endif
+}
+
+#elif !defined(_WIN32)
+
+size_t node_count() { return 1; }
+void bindThisThreadToNode(size_t) {}
 void bindThisThread(size_t) {}
+bool interleave(void*, size_t) { return false; }
 
 #else
 
@@ -1342,6 +1715,24 @@ int best_group(size_t idx) {
 }
 
 
+/// set_group_affinity() restricts the current thread to the processors of the
+/// given NUMA node
+
+static bool set_group_affinity(int group) {
+
+  // Early exit if the needed API are not available at runtime
+  HMODULE k32 = GetModuleHandle("Kernel32.dll");
+  auto fun2 = (fun2_t)(void(*)())GetProcAddress(k32, "GetNumaNodeProcessorMaskEx");
+  auto fun3 = (fun3_t)(void(*)())GetProcAddress(k32, "SetThreadGroupAffinity");
+
+  if (!fun2 || !fun3)
+      return false;
+
+  GROUP_AFFINITY affinity;
+  return fun2(group, &affinity) && fun3(GetCurrentThread(), &affinity, nullptr);
+}
+
+
 /// bindThisThread() set the group affinity of the current thread
 
 void bindThisThread(size_t idx) {
@@ -1352,22 +1743,21 @@ void bindThisThread(size_t idx) {
   if (group == -1)
       return;
 
-  // Early exit if the needed API are not available at runtime
-  HMODULE k32 = GetModuleHandle("Kernel32.dll");
-  auto fun2 = (fun2_t)(void(*)())GetProcAddress(k32, "GetNumaNodeProcessorMaskEx");
-  auto fun3 = (fun3_t)(void(*)())GetProcAddress(k32, "SetThreadGroupAffinity");
+  if (set_group_affinity(group))
+	  sync_cout << "info string Binding thread " << idx << " to group " << group << sync_endl;
+}
 
-  if (!fun2 || !fun3)
-      return;
 
-  GROUP_AFFINITY affinity;
-  if (fun2(group, &affinity))
-  {
-	  sync_cout << "info string Binding thread " << idx << " to group " << group << sync_endl;
-      fun3(GetCurrentThread(), &affinity, nullptr);
-  }
+size_t node_count() {
+
+  ULONG highest;
+  return GetNumaHighestNodeNumber(&highest) ? size_t(highest) + 1 : 1;
 }
 
+void bindThisThreadToNode(size_t node) { set_group_affinity(int(node)); }
+
+bool interleave(void*, size_t) { return false; }
+
 #endif
 
 } // namespace WinProcGroup
@@ -58,6 +58,41 @@ void std_aligned_free(void* ptr);
 void* aligned_large_pages_alloc(size_t size); // memory aligned by page size, min alignment: 4096 bytes
 void aligned_large_pages_free(void* mem); // nop if mem == nullptr
 
+/// MemoryMappedFile maps a whole existing file into memory. Pages are faulted
+/// in on demand, and in a writable mapping the OS keeps track of the modified
+/// pages, so that flush() only writes back what has actually changed.
+
+class MemoryMappedFile {
+
+public:
+  MemoryMappedFile() = default;
+  MemoryMappedFile(const MemoryMappedFile&) = delete;
+  MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+ ~MemoryMappedFile() { unmap(); }
+
+  bool map(const std::string& fname, bool writable);
+  void unmap();
+  bool flush(size_t offset, size_t len) const;
+  void will_need() const;
+  bool is_mapped() const { return mem != nullptr; }
+  char* data() const { return mem; }
+  size_t size() const { return mapSize; }
+  const std::string& file_name() const { return fileName; }
+
+private:
+  char* mem = nullptr;
+  size_t mapSize = 0;
+  std::string fileName;
+#if defined(_WIN32)
+  void* fileHandle = nullptr;
+  void* mapHandle = nullptr;
+#else
+  int fd = -1;
+#endif
+};
+
+uint32_t crc32(const void* data, size_t len, uint32_t crc = 0);
+
 void dbg_hit_on(bool b);
 void dbg_hit_on(bool c, bool b);
 void dbg_mean_of(int v);
@@ -70,12 +105,22 @@ inline TimePoint now() {
         (std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+inline int64_t now_us() { // Same clock as now(), in microseconds
+  return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 template<class Entry, int Size>
 struct HashTable {
   Entry* operator[](Key key) { return &table[(uint32_t)key & (Size - 1)]; }
 
+  // Allocated on the heap, on first use by the owning thread so that its pages
+  // are first touched on the NUMA node that thread runs on.
+  void allocate() { if (table.empty()) table = std::vector<Entry>(Size); }
+  static constexpr size_t bytes() { return sizeof(Entry) * Size; }
+
 private:
-  std::vector<Entry> table = std::vector<Entry>(Size); // Allocate on the heap
+  std::vector<Entry> table;
 };
 
 
@@ -212,10 +257,14 @@ inline uint64_t mul_hi64(uint64_t a, uint64_t b) {
 /// logical processor group. This usually means to be limited to use max 64
 /// cores. To overcome this, some special platform specific API should be
 /// called to set group affinity for each thread. Original code from Texel by
-/// Peter Österlund.
+/// Peter Österlund. On Linux the threads are bound to the NUMA nodes read
+/// from sysfs in the same way. Both do nothing on a single node machine.
 
 namespace WinProcGroup {
   void bindThisThread(size_t idx);
+  void bindThisThreadToNode(size_t node);
+  size_t node_count();
+  bool interleave(void* mem, size_t size);
 }
 
 namespace CommandLine {
@@ -18,15 +18,18 @@
 
 // Code for calculating NNUE evaluation function
 
+#include <cstring>
 #include <iostream>
 #include <set>
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <type_traits>
 
 #include "../evaluate.h"
 #include "../position.h"
 #include "../misc.h"
+#include "../thread.h"
 #include "../uci.h"
 #include "../types.h"
 
@@ -34,16 +37,25 @@
 
 namespace Stockfish::Eval::NNUE {
 
-  // Input feature converter
-  LargePagePtr<FeatureTransformer> featureTransformer;
+  // Input feature converter and evaluation function. They either point to
+  // memory owned by the process, where a .nnue file is read, or into a mapped
+  // prepared net file (see load_prepared()).
+  LargePagePtr<FeatureTransformer> featureTransformerStorage;
+  AlignedPtr<Network> networkStorage[LayerStacks];
+  MemoryMappedFile mappedNet;
 
-  // Evaluation function
-  AlignedPtr<Network> network[LayerStacks];
+  const FeatureTransformer* featureTransformer;
+  const Network* network[LayerStacks];
+
+  std::uint32_t NetGeneration;
 
   // Evaluation function file name
   std::string fileName;
   std::string netDescription;
 
+  // Number of positions of one bucket which evaluate_batch() propagates together
+  constexpr std::size_t BatchSize = 64;
+
   namespace Detail {
 
   // Initialize the evaluation function parameters
@@ -85,9 +97,75 @@ namespace Stockfish::Eval::NNUE {
   // Initialize the evaluation function parameters
   void initialize() {
 
-    Detail::initialize(featureTransformer);
+    mappedNet.unmap();
+    ++NetGeneration;
+
+    Detail::initialize(featureTransformerStorage);
+    featureTransformer = featureTransformerStorage.get();
+
     for (std::size_t i = 0; i < LayerStacks; ++i)
-      Detail::initialize(network[i]);
+    {
+      Detail::initialize(networkStorage[i]);
+      network[i] = networkStorage[i].get();
+    }
+  }
+
+  // A prepared net is a memory image of the feature transformer and of the
+  // layer stacks, with the weights already permuted for the SIMD instruction
+  // set of the build. It is mapped read-only instead of being read, so loading
+  // costs nothing and all the engine processes of a host share one copy of it
+  // in the page cache. The header must match the build exactly.
+  constexpr char PreparedMagic[8] = { 'S', 'u', 'g', 'a', 'R', 'N', 'e', 't' };
+  constexpr std::uint32_t PreparedVersion = 1;
+  constexpr std::size_t PreparedAlignment = 4096;
+
+  // Weight layout of the affine transforms, which depends on the SIMD width
+  constexpr std::uint32_t SimdLayout =
+#if defined(USE_AVX512)
+      512;
+#elif defined(USE_AVX2)
+      256;
+#elif defined(USE_SSSE3)
+      128;
+#else
+      0;
+#endif
+
+  struct PreparedHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t hashValue;
+    std::uint32_t simdLayout;
+    std::uint32_t byteOrder;      // 1 in the byte order of the machine
+    std::uint64_t transformerSize;
+    std::uint64_t networkSize;
+    std::uint64_t descriptionOffset;
+    std::uint64_t descriptionSize;
+    std::uint64_t transformerOffset;
+    std::uint64_t networkOffset;  // Layer stack i is at networkOffset + i * networkStride
+    std::uint64_t networkStride;
+  };
+
+  static_assert(std::is_trivially_copyable<FeatureTransformer>::value);
+  static_assert(std::is_trivially_copyable<Network>::value);
+  static_assert(alignof(FeatureTransformer) <= PreparedAlignment && alignof(Network) <= PreparedAlignment);
+
+  PreparedHeader prepared_header(std::size_t descriptionSize) {
+
+    PreparedHeader h{};
+    std::memcpy(h.magic, PreparedMagic, sizeof(h.magic));
+    h.version = PreparedVersion;
+    h.hashValue = HashValue;
+    h.simdLayout = SimdLayout;
+    h.byteOrder = 1;
+    h.transformerSize = sizeof(FeatureTransformer);
+    h.networkSize = sizeof(Network);
+    h.descriptionOffset = sizeof(PreparedHeader);
+    h.descriptionSize = descriptionSize;
+    h.transformerOffset = ceil_to_multiple<std::uint64_t>(h.descriptionOffset + descriptionSize, PreparedAlignment);
+    h.networkStride = ceil_to_multiple<std::uint64_t>(sizeof(Network), alignof(Network));
+    h.networkOffset = ceil_to_multiple<std::uint64_t>(h.transformerOffset + sizeof(FeatureTransformer), PreparedAlignment);
+    return h;
   }
 
   // Read network header
@@ -120,9 +198,9 @@ namespace Stockfish::Eval::NNUE {
     std::uint32_t hashValue;
     if (!read_header(stream, &hashValue, &netDescription)) return false;
     if (hashValue != HashValue) return false;
-    if (!Detail::read_parameters(stream, *featureTransformer)) return false;
+    if (!Detail::read_parameters(stream, *featureTransformerStorage)) return false;
     for (std::size_t i = 0; i < LayerStacks; ++i)
-      if (!Detail::read_parameters(stream, *(network[i]))) return false;
+      if (!Detail::read_parameters(stream, *(networkStorage[i]))) return false;
     return stream && stream.peek() == std::ios::traits_type::eof();
   }
 
@@ -136,6 +214,20 @@ namespace Stockfish::Eval::NNUE {
     return (bool)stream;
   }
 
+  // Blend of the psqt and positional outputs of the network, scaled to a Value
+  static Value final_value(const Position& pos, int materialist, int positional, bool adjusted) {
+
+    int delta_npm = abs(pos.non_pawn_material(WHITE) - pos.non_pawn_material(BLACK));
+    int entertainment = (adjusted && delta_npm <= BishopValueMg - KnightValueMg ? 7 : 0);
+
+    int A = 128 - entertainment + MaterialisticEvaluationStrategy;
+    int B = 128 + entertainment + PositionalEvaluationStrategy;
+
+    int sum = (A * materialist + B * positional) / 128;
+
+    return static_cast<Value>( sum / OutputScale );
+  }
+
   // Evaluation function. Perform differential calculation.
   Value evaluate(const Position& pos, bool adjusted) {
 
@@ -161,21 +253,70 @@ namespace Stockfish::Eval::NNUE {
     ASSERT_ALIGNED(buffer, alignment);
 
     const std::size_t bucket = (pos.count<ALL_PIECES>() - 1) / 4;
-    const auto psqt = featureTransformer->transform(pos, transformedFeatures, bucket);
+    const auto psqt = featureTransformer->transform(pos, transformedFeatures, bucket,
+                                                    &pos.this_thread()->accumulatorCache);
     const auto output = network[bucket]->propagate(transformedFeatures, buffer);
 
-    int materialist = psqt;
-    int positional  = output[0];
+    return final_value(pos, psqt, output[0], adjusted);
+  }
 
-    int delta_npm = abs(pos.non_pawn_material(WHITE) - pos.non_pawn_material(BLACK));
-    int entertainment = (adjusted && delta_npm <= BishopValueMg - KnightValueMg ? 7 : 0);
+  // Batch evaluation, same results as evaluate() for every position. The
+  // positions are grouped by layer stack bucket, and the network of a bucket
+  // propagates up to BatchSize positions at a time, one layer after the other,
+  // with the first hidden layer computing several positions per pass over its
+  // weights. The accumulator refresh cache is not used, since the positions
+  // may all belong to one thread while several threads evaluate them.
+  void evaluate_batch(const Position* const* positions, Value* values, std::size_t count, bool adjusted) {
 
-    int A = 128 - entertainment + MaterialisticEvaluationStrategy;
-    int B = 128 + entertainment + PositionalEvaluationStrategy;
+    constexpr std::size_t FeatureStride = FeatureTransformer::BufferSize;
+    constexpr std::size_t BufferStride  = Network::BufferSize;
 
-    int sum = (A * materialist + B * positional) / 128;
+    static_assert(FeatureStride * sizeof(TransformedFeatureType) % CacheLineSize == 0);
+    static_assert(BufferStride % CacheLineSize == 0);
 
-    return static_cast<Value>( sum / OutputScale );
+    // Counting sort of the positions by bucket
+    std::vector<std::size_t> order(count);
+    std::size_t bucketStart[LayerStacks + 1] = {};
+
+    for (std::size_t i = 0; i < count; ++i)
+        ++bucketStart[(positions[i]->count<ALL_PIECES>() - 1) / 4 + 1];
+
+    for (std::size_t b = 0; b < LayerStacks; ++b)
+        bucketStart[b + 1] += bucketStart[b];
+
+    std::size_t next[LayerStacks];
+    std::copy(bucketStart, bucketStart + LayerStacks, next);
+
+    for (std::size_t i = 0; i < count; ++i)
+        order[next[(positions[i]->count<ALL_PIECES>() - 1) / 4]++] = i;
+
+    std::vector<TransformedFeatureType> featureStorage(BatchSize * FeatureStride + CacheLineSize);
+    std::vector<char> bufferStorage(BatchSize * BufferStride + CacheLineSize);
+    std::int32_t psqt[BatchSize];
+
+    auto* transformedFeatures = align_ptr_up<CacheLineSize>(featureStorage.data());
+    auto* buffer = align_ptr_up<CacheLineSize>(bufferStorage.data());
+
+    for (std::size_t bucket = 0; bucket < LayerStacks; ++bucket)
+        for (std::size_t first = bucketStart[bucket]; first < bucketStart[bucket + 1]; first += BatchSize)
+        {
+            const std::size_t n = std::min(BatchSize, bucketStart[bucket + 1] - first);
+
+            for (std::size_t k = 0; k < n; ++k)
+                psqt[k] = featureTransformer->transform(*positions[order[first + k]],
+                                                        transformedFeatures + k * FeatureStride, bucket);
+
+            network[bucket]->propagate_batch(transformedFeatures, FeatureStride, buffer, BufferStride, n);
+
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                const Position& pos = *positions[order[first + k]];
+                const auto output = network[bucket]->batch_output(transformedFeatures + k * FeatureStride,
+                                                                  buffer + k * BufferStride);
+
+                values[order[first + k]] = final_value(pos, psqt[k], output[0], adjusted);
+            }
+        }
   }
 
   struct NnueEvalTrace {
@@ -377,6 +518,118 @@ namespace Stockfish::Eval::NNUE {
     return read_parameters(stream);
   }
 
+  // Load eval, by mapping a prepared net file. Returns false, without touching
+  // the current net, if the file is not a prepared net for this build.
+  bool load_prepared(const std::string& name, const std::string& path) {
+
+    MemoryMappedFile file;
+    PreparedHeader h;
+
+    if (!file.map(path, false) || file.size() < sizeof(h))
+        return false;
+
+    std::memcpy(&h, file.data(), sizeof(h));
+    const PreparedHeader expected = prepared_header(h.descriptionSize);
+
+    if (   std::memcmp(h.magic, expected.magic, sizeof(h.magic))
+        || h.version != expected.version
+        || h.hashValue != expected.hashValue
+        || h.simdLayout != expected.simdLayout
+        || h.byteOrder != expected.byteOrder
+        || h.transformerSize != expected.transformerSize
+        || h.networkSize != expected.networkSize
+        || h.descriptionOffset != expected.descriptionOffset
+        || h.transformerOffset != expected.transformerOffset
+        || h.networkOffset != expected.networkOffset
+        || h.networkStride != expected.networkStride
+        || file.size() < h.networkOffset + LayerStacks * h.networkStride)
+        return false;
+
+    // The file is good, map it for good. The mapping of 'file' goes away with
+    // it, the pages stay in the page cache.
+    file.unmap();
+    featureTransformerStorage.reset();
+    for (std::size_t i = 0; i < LayerStacks; ++i)
+        networkStorage[i].reset();
+
+    if (!mappedNet.map(path, false) || mappedNet.size() < h.networkOffset + LayerStacks * h.networkStride)
+    {
+        initialize();
+        return false;
+    }
+
+    // The mapping is not backed by our large pages, at least read it in before
+    // the search so that the first evaluations do not wait for page faults.
+    mappedNet.will_need();
+
+    ++NetGeneration;
+    const char* base = mappedNet.data();
+    featureTransformer = reinterpret_cast<const FeatureTransformer*>(base + h.transformerOffset);
+    for (std::size_t i = 0; i < LayerStacks; ++i)
+        network[i] = reinterpret_cast<const Network*>(base + h.networkOffset + i * h.networkStride);
+
+    fileName = name;
+    netDescription.assign(base + h.descriptionOffset, h.descriptionSize);
+    return true;
+  }
+
+  // Save eval, as a prepared net file
+  bool save_prepared(const std::string& filename) {
+
+    const PreparedHeader h = prepared_header(netDescription.size());
+    std::ofstream stream(filename, std::ios::binary | std::ios::trunc);
+
+    auto pad_to = [&](std::uint64_t offset) {
+        while (std::uint64_t(stream.tellp()) < offset)
+            stream.put(0);
+    };
+
+    stream.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    stream.write(netDescription.data(), netDescription.size());
+    pad_to(h.transformerOffset);
+    stream.write(reinterpret_cast<const char*>(featureTransformer), sizeof(FeatureTransformer));
+
+    for (std::size_t i = 0; i < LayerStacks; ++i)
+    {
+        pad_to(h.networkOffset + i * h.networkStride);
+        stream.write(reinterpret_cast<const char*>(network[i]), sizeof(Network));
+    }
+
+    return (bool)stream;
+  }
+
+  // prepare_net() implements the prepare_net command, which converts a .nnue
+  // file into a prepared net for this build, see load_prepared().
+  void prepare_net(int argc, char* argv[]) {
+
+    if (argc < 2)
+    {
+        sync_cout << "info string Error : Incorrect prepare_net command" << sync_endl;
+        sync_cout << "info string Syntax: prepare_net <input.nnue> <output>" << sync_endl;
+        return;
+    }
+
+    const std::string inFile  = Utility::map_path(Utility::unquote(argv[0]));
+    const std::string outFile = Utility::map_path(Utility::unquote(argv[1]));
+
+    std::ifstream stream(inFile, std::ios::binary);
+    if (!load_eval(inFile, stream))
+    {
+        sync_cout << "info string Could not load the net " << inFile << sync_endl;
+        return;
+    }
+
+    if (!save_prepared(outFile))
+    {
+        sync_cout << "info string Could not write " << outFile << sync_endl;
+        return;
+    }
+
+    sync_cout << "info string Prepared net " << outFile << " written for this build ("
+              << (SimdLayout ? std::to_string(SimdLayout) + " bit SIMD" : std::string("no SIMD"))
+              << " layout)" << sync_endl;
+  }
+
   // Save eval, to a file stream or a memory stream
   bool save_eval(std::ostream& stream) {
 
@@ -416,5 +669,239 @@ namespace Stockfish::Eval::NNUE {
     return saved;
   }
 
+  // evaluate_batch_file() implements the evalbatch command. Every FEN or EPD line
+  // of the input file is scored by the network, from the side to move point of
+  // view, and written to the output file with a 'ce' operation appended. The
+  // input is read ReadSize lines at a time, and the chunks of such a block are
+  // scored with evaluate_batch() by all the threads of the pool.
+  void evaluate_batch_file(int argc, char* argv[]) {
+
+    if (argc < 2)
+    {
+        sync_cout << "info string Error : Incorrect evalbatch command" << sync_endl;
+        sync_cout << "info string Syntax: evalbatch <input> <output>" << sync_endl;
+        return;
+    }
+
+    if (!useNNUE)
+    {
+        sync_cout << "info string Error : evalbatch needs the NNUE evaluation (Use NNUE)" << sync_endl;
+        return;
+    }
+
+    verify();
+
+    const std::string inFile  = Utility::map_path(Utility::unquote(argv[0]));
+    const std::string outFile = Utility::map_path(Utility::unquote(argv[1]));
+
+    std::ifstream in(inFile);
+    if (!in.is_open())
+    {
+        sync_cout << "info string Could not open " << inFile << " for reading" << sync_endl;
+        return;
+    }
+
+    std::ofstream out(outFile, std::ios::out | std::ios::trunc);
+    if (!out.is_open())
+    {
+        sync_cout << "info string Could not open " << outFile << " for writing" << sync_endl;
+        return;
+    }
+
+    constexpr std::size_t ChunkSize = 1024;
+    constexpr std::size_t ReadSize  = 64 * ChunkSize;
+    const bool chess960 = Options["UCI_Chess960"];
+    const TimePoint start = now();
+    std::vector<std::string> lines;
+    std::vector<Value> values;
+    std::size_t total = 0;
+
+    while (in)
+    {
+        lines.clear();
+        for (std::string line; lines.size() < ReadSize && std::getline(in, line); )
+            if (line.find_first_not_of(" \t\r") != std::string::npos)
+                lines.push_back(line.substr(0, line.find_last_not_of(" \t\r") + 1));
+
+        values.resize(lines.size());
+
+        Threads.parallel_for((lines.size() + ChunkSize - 1) / ChunkSize, [&](std::size_t chunk) {
+
+            const std::size_t first = chunk * ChunkSize;
+            const std::size_t n = std::min(ChunkSize, lines.size() - first);
+            std::vector<StateInfo> states(n);
+            std::vector<Position> positions(n);
+            std::vector<const Position*> batch(n);
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                positions[i].set(lines[first + i], chess960, &states[i], Threads.main());
+                batch[i] = &positions[i];
+            }
+
+            evaluate_batch(batch.data(), &values[first], n);
+        });
+
+        for (std::size_t i = 0; i < lines.size(); ++i)
+            out << lines[i] << " ce " << 100 * values[i] / PawnValueEg << ";\n";
+
+        total += lines.size();
+    }
+
+    const TimePoint elapsed = now() - start + 1;
+
+    sync_cout << "info string evalbatch: " << total << " positions evaluated in "
+              << elapsed << " ms (" << 1000 * total / elapsed << " positions/s)" << sync_endl;
+  }
+
+  // Runs the layers below 'layer' and then 'layer' itself on the transformed
+  // features, timing 'iterations' forward propagations of each layer.
+  template <typename Layer>
+  static const typename Layer::OutputType* bench_layer(
+      const Layer& layer, const TransformedFeatureType* features, char* buffer,
+      int iterations, std::vector<std::pair<std::string, double>>& times) {
+
+    if constexpr (std::is_same_v<Layer, Layers::InputLayer>)
+        return layer.propagate(features, buffer);
+    else
+    {
+        const auto input = bench_layer(layer.previous_layer(), features,
+                                       buffer + Layer::SelfBufferSize, iterations, times);
+
+        std::ostringstream name;
+        if constexpr (std::is_same_v<typename Layer::OutputType, std::int32_t>)
+            name << "AffineTransform " << Layer::InputDimensions << "->" << Layer::OutputDimensions;
+        else
+            name << "ClippedReLU " << Layer::OutputDimensions;
+
+        // The input is read through a volatile pointer, so that the compiler
+        // cannot hoist the computation out of the loop.
+        const typename Layer::InputType* volatile in = input;
+        const typename Layer::OutputType* output = nullptr;
+        const int64_t start = now_us();
+        for (int i = 0; i < iterations; ++i)
+            output = layer.forward(in, buffer);
+
+        times.emplace_back(name.str(), 1000.0 * (now_us() - start) / iterations);
+        return output;
+    }
+  }
+
+  // bench_layers() implements the nnuebench command. It reports the time of one
+  // forward propagation of the feature transformer output and of every layer of
+  // the network for the given position, so that the kernels of the different
+  // SIMD builds can be compared layer by layer, and the time per position of
+  // the network run one position at a time and in batches.
+  void bench_layers(const Position& pos, int iterations) {
+
+    constexpr const char* Simd =
+#if defined(USE_AVX512) && defined(USE_VNNI)
+        "AVX-512 VNNI";
+#elif defined(USE_AVX512)
+        "AVX-512";
+#elif defined(USE_AVXVNNI)
+        "AVX-VNNI";
+#elif defined(USE_VNNI)
+        "AVX-512 VNNI 256 bit";
+#elif defined(USE_AVX2)
+        "AVX2";
+#elif defined(USE_SSE41)
+        "SSE4.1";
+#elif defined(USE_SSSE3)
+        "SSSE3";
+#elif defined(USE_SSE2)
+        "SSE2";
+#elif defined(USE_MMX)
+        "MMX";
+#elif defined(USE_NEON)
+        "NEON";
+#else
+        "generic";
+#endif
+
+    if (!useNNUE)
+    {
+        sync_cout << "info string nnuebench needs Use NNUE" << sync_endl;
+        return;
+    }
+
+    iterations = std::max(iterations, 1);
+
+    std::vector<TransformedFeatureType> featureStorage(FeatureTransformer::BufferSize + CacheLineSize);
+    std::vector<char> bufferStorage(Network::BufferSize + CacheLineSize);
+    auto* transformedFeatures = align_ptr_up<CacheLineSize>(featureStorage.data());
+    auto* buffer = align_ptr_up<CacheLineSize>(bufferStorage.data());
+
+    const std::size_t bucket = (pos.count<ALL_PIECES>() - 1) / 4;
+    std::vector<std::pair<std::string, double>> times;
+
+    // The accumulators are computed by the first call, the loop only times the
+    // conversion of the accumulators into the input of the network.
+    featureTransformer->transform(pos, transformedFeatures, bucket);
+    const int64_t start = now_us();
+    for (int i = 0; i < iterations; ++i)
+        featureTransformer->transform(pos, transformedFeatures, bucket);
+
+    std::ostringstream name;
+    name << "FeatureTransformer " << FeatureTransformer::OutputDimensions;
+    times.emplace_back(name.str(), 1000.0 * (now_us() - start) / iterations);
+
+    const auto output = bench_layer(*network[bucket], transformedFeatures, buffer, iterations, times);
+
+    // The whole network on BatchSize copies of the transformed features, first
+    // one copy after the other as evaluate() does and then with the batch path
+    // of evaluate_batch(), which leaves out the accumulator refresh and the
+    // position setup that dominate the cost of evalbatch.
+    constexpr std::size_t FeatureStride = FeatureTransformer::BufferSize;
+    constexpr std::size_t BufferStride  = Network::BufferSize;
+
+    std::vector<TransformedFeatureType> batchFeatureStorage(BatchSize * FeatureStride + CacheLineSize);
+    std::vector<char> batchBufferStorage(BatchSize * BufferStride + CacheLineSize);
+    auto* batchFeatures = align_ptr_up<CacheLineSize>(batchFeatureStorage.data());
+    auto* batchBuffer = align_ptr_up<CacheLineSize>(batchBufferStorage.data());
+
+    for (std::size_t k = 0; k < BatchSize; ++k)
+        std::copy(transformedFeatures, transformedFeatures + FeatureStride, batchFeatures + k * FeatureStride);
+
+    const int64_t singleStart = now_us();
+    for (int i = 0; i < iterations; ++i)
+        for (std::size_t k = 0; k < BatchSize; ++k)
+            network[bucket]->propagate(batchFeatures + k * FeatureStride, batchBuffer + k * BufferStride);
+
+    const double single = 1000.0 * (now_us() - singleStart) / iterations / BatchSize;
+
+    const int64_t batchStart = now_us();
+    for (int i = 0; i < iterations; ++i)
+        network[bucket]->propagate_batch(batchFeatures, FeatureStride, batchBuffer, BufferStride, BatchSize);
+
+    const double batch = 1000.0 * (now_us() - batchStart) / iterations / BatchSize;
+
+    bool same = true;
+    for (std::size_t k = 0; k < BatchSize; ++k)
+        same &= network[bucket]->batch_output(batchFeatures + k * FeatureStride,
+                                              batchBuffer + k * BufferStride)[0] == output[0];
+
+    double total = 0;
+    for (const auto& [layer, ns] : times)
+        total += ns;
+
+    sync_cout << "info string nnuebench " << Simd << ", bucket " << bucket
+              << ", " << iterations << " iterations, output " << output[0] << sync_endl;
+
+    for (const auto& [layer, ns] : times)
+        sync_cout << "info string " << std::left << std::setw(28) << layer
+                  << std::right << std::fixed << std::setprecision(1) << std::setw(8) << ns << " ns/eval" << sync_endl;
+
+    sync_cout << "info string " << std::left << std::setw(28) << "Total"
+              << std::right << std::fixed << std::setprecision(1) << std::setw(8) << total << " ns/eval" << sync_endl;
+
+    sync_cout << "info string " << std::left << std::setw(28) << "Network, one by one"
+              << std::right << std::fixed << std::setprecision(1) << std::setw(8) << single << " ns/eval" << sync_endl;
+
+    sync_cout << "info string " << std::left << std::setw(28) << "Network, batches of " + std::to_string(BatchSize)
+              << std::right << std::fixed << std::setprecision(1) << std::setw(8) << batch << " ns/eval"
+              << (same ? "" : " (output differs)") << sync_endl;
+  }
+
 
 } // namespace Stockfish::Eval::NNUE
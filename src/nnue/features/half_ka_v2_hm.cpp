@@ -70,6 +70,31 @@ namespace Stockfish::Eval::NNUE::Features {
     }
   }
 
+  // append_board_changes() : get a list of indices for the features that
+  // differ between the position and the given board
+
+  void HalfKAv2_hm::append_board_changes(
+    const Position& pos,
+    Color perspective,
+    const Bitboard byColorBB[COLOR_NB],
+    const Bitboard byTypeBB[PIECE_TYPE_NB],
+    ValueListInserter<IndexType> removed,
+    ValueListInserter<IndexType> added
+  ) {
+    Square ksq = pos.square<KING>(perspective);
+    for (Color c : { WHITE, BLACK })
+      for (PieceType pt = PAWN; pt <= KING; ++pt)
+      {
+        Piece pc = make_piece(c, pt);
+        Bitboard before = byColorBB[c] & byTypeBB[pt];
+        Bitboard after = pos.pieces(c, pt);
+        for (Bitboard bb = before & ~after; bb; )
+          removed.push_back(make_index(perspective, pop_lsb(bb), pc, ksq));
+        for (Bitboard bb = after & ~before; bb; )
+          added.push_back(make_index(perspective, pop_lsb(bb), pc, ksq));
+      }
+  }
+
   int HalfKAv2_hm::update_cost(StateInfo* st) {
     return st->dirtyPiece.dirty_num;
   }
@@ -107,6 +107,16 @@ namespace Stockfish::Eval::NNUE::Features {
       ValueListInserter<IndexType> removed,
       ValueListInserter<IndexType> added);
 
+    // Get a list of indices for the features that differ between the position
+    // and a board given by its bitboards, with the king on the same square
+    static void append_board_changes(
+      const Position& pos,
+      Color perspective,
+      const Bitboard byColorBB[COLOR_NB],
+      const Bitboard byTypeBB[PIECE_TYPE_NB],
+      ValueListInserter<IndexType> removed,
+      ValueListInserter<IndexType> added);
+
     // Returns the cost of updating one perspective, the most costly one.
     // Assumes no refresh needed.
     static int update_cost(StateInfo* st);
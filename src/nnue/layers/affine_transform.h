@@ -41,6 +41,8 @@
     - N columns of the weight matrix are processed a time, where N
       depends on the architecture (the amount of registers)
     - accumulate + hadd is used
+    - for a batch, the columns of BatchInputs inputs are processed together,
+      so that the weights are loaded once for all of them
 
   Approach 2:
     - used when the PaddedInputDimensions < 128
@@ -200,6 +202,11 @@ namespace Stockfish::Eval::NNUE::Layers {
 
     static_assert(OutputDimensions % NumOutputRegs == 0);
 
+    // Number of inputs of a batch computed by one pass over the weights. The
+    // accumulators of two inputs still fit in the registers with half the
+    // outputs per pass on AVX2 and SSSE3, and with all of them on AVX512.
+    static constexpr const IndexType BatchInputs = 2;
+
     // Size of forward propagation buffer used in this layer
     static constexpr std::size_t SelfBufferSize =
       ceil_to_multiple(OutputDimensions * sizeof(OutputType), CacheLineSize);
@@ -265,9 +272,64 @@ namespace Stockfish::Eval::NNUE::Layers {
     // Forward propagation
     const OutputType* propagate(
         const TransformedFeatureType* transformedFeatures, char* buffer) const {
-      const auto input = previousLayer.propagate(
-        transformedFeatures, buffer + SelfBufferSize);
+      return forward(previousLayer.propagate(
+        transformedFeatures, buffer + SelfBufferSize), buffer);
+    }
+
+    // Forward propagation of a batch of inputs, one layer at a time for all of
+    // them. This layer computes BatchInputs inputs per pass over the weights.
+    // Input i is read from transformedFeatures + i * featureStride and uses
+    // buffer + i * bufferStride.
+    void propagate_batch(
+        const TransformedFeatureType* transformedFeatures, std::size_t featureStride,
+        char* buffer, std::size_t bufferStride, std::size_t count) const {
+      previousLayer.propagate_batch(
+        transformedFeatures, featureStride, buffer + SelfBufferSize, bufferStride, count);
+
+      std::size_t i = 0;
+      for ( ; i + BatchInputs <= count; i += BatchInputs)
+      {
+        const InputType* input[BatchInputs];
+        OutputType* output[BatchInputs];
+
+        for (IndexType n = 0; n < BatchInputs; ++n)
+        {
+          input[n] = previousLayer.batch_output(transformedFeatures + (i + n) * featureStride,
+                                                buffer + SelfBufferSize + (i + n) * bufferStride);
+          output[n] = reinterpret_cast<OutputType*>(buffer + (i + n) * bufferStride);
+        }
+
+        forward_inputs<BatchInputs>(input, output);
+      }
+
+      for ( ; i < count; ++i)
+        forward(previousLayer.batch_output(transformedFeatures + i * featureStride,
+                                           buffer + SelfBufferSize + i * bufferStride),
+                buffer + i * bufferStride);
+    }
+
+    // Output of one input of propagate_batch(), given the buffers it used
+    const OutputType* batch_output(
+        const TransformedFeatureType* /*transformedFeatures*/, char* buffer) const {
+      return reinterpret_cast<const OutputType*>(buffer);
+    }
+
+    // Layer below this one, to run and time the layers one by one
+    const PreviousLayer& previous_layer() const { return previousLayer; }
+
+    // Forward propagation of this layer only
+    const OutputType* forward(const InputType* input, char* buffer) const {
       OutputType* output = reinterpret_cast<OutputType*>(buffer);
+      forward_inputs<1>(&input, &output);
+      return output;
+    }
+
+    // Forward propagation of this layer for N inputs at once. The outputs of a
+    // big block are computed OutputsPerPass at a time for all the N inputs, so
+    // that every weight vector loaded is used N times. With N = 1 this is the
+    // usual one pass per big block.
+    template <IndexType N>
+    void forward_inputs(const InputType* const* input, OutputType* const* output) const {
 
 #if defined (USE_AVX512)
       using vec_t = __m512i;
@@ -296,52 +358,75 @@ namespace Stockfish::Eval::NNUE::Layers {
 #endif
 
 #if defined (USE_SSSE3)
-      const vec_t* invec = reinterpret_cast<const vec_t*>(input);
+      constexpr IndexType OutputsPerPass = std::min(NumOutputRegs, MaxNumOutputRegs / N);
 
+      static_assert(N <= MaxNumOutputRegs);
+      static_assert(NumOutputRegs % OutputsPerPass == 0);
+
+      const vec_t* invec[N];
+      for (IndexType n = 0; n < N; ++n)
+        invec[n] = reinterpret_cast<const vec_t*>(input[n]);
 
       // Perform accumulation to registers for each big block
       for (IndexType bigBlock = 0; bigBlock < NumBigBlocks; ++bigBlock)
-      {
-        vec_t acc[NumOutputRegs] = { vec_setzero() };
-
-        // Each big block has NumOutputRegs small blocks in each "row", one per register.
-        // We process two small blocks at a time to save on one addition without VNNI.
-        for (IndexType smallBlock = 0; smallBlock < NumSmallBlocksPerOutput; smallBlock += 2)
+        for (IndexType pass = 0; pass < NumOutputRegs; pass += OutputsPerPass)
         {
-          const vec_t* weightvec =
-            reinterpret_cast<const vec_t*>(
-                weights
-              + bigBlock * BigBlockSize
-              + smallBlock * SmallBlockSize * NumOutputRegs);
-
-          const vec_t in0 = invec[smallBlock + 0];
-          const vec_t in1 = invec[smallBlock + 1];
-
-          for (IndexType k = 0; k < NumOutputRegs; ++k)
-            vec_add_dpbusd_32x2(acc[k], in0, weightvec[k], in1, weightvec[k + NumOutputRegs]);
-        }
-
-        // Horizontally add all accumulators.
-        if constexpr (NumOutputRegs % 4 == 0)
-        {
-          __m128i* outputvec = reinterpret_cast<__m128i*>(output);
-          const __m128i* biasvec = reinterpret_cast<const __m128i*>(biases);
-
-          for (IndexType k = 0; k < NumOutputRegs; k += 4)
+          vec_t acc[N][OutputsPerPass];
+          for (IndexType n = 0; n < N; ++n)
+            for (IndexType k = 0; k < OutputsPerPass; ++k)
+              acc[n][k] = vec_setzero();
+
+          // Each big block has NumOutputRegs small blocks in each "row", one per register.
+          // We process two small blocks at a time to save on one addition without VNNI.
+          for (IndexType smallBlock = 0; smallBlock < NumSmallBlocksPerOutput; smallBlock += 2)
           {
-            const IndexType idx = (bigBlock * NumOutputRegs + k) / 4;
-            outputvec[idx] = vec_haddx4(acc[k+0], acc[k+1], acc[k+2], acc[k+3], biasvec[idx]);
+            const vec_t* weightvec =
+              reinterpret_cast<const vec_t*>(
+                  weights
+                + bigBlock * BigBlockSize
+                + smallBlock * SmallBlockSize * NumOutputRegs) + pass;
+
+            vec_t in0[N], in1[N];
+            for (IndexType n = 0; n < N; ++n)
+            {
+              in0[n] = invec[n][smallBlock + 0];
+              in1[n] = invec[n][smallBlock + 1];
+            }
+
+            for (IndexType k = 0; k < OutputsPerPass; ++k)
+            {
+              const vec_t w0 = weightvec[k];
+              const vec_t w1 = weightvec[k + NumOutputRegs];
+
+              for (IndexType n = 0; n < N; ++n)
+                vec_add_dpbusd_32x2(acc[n][k], in0[n], w0, in1[n], w1);
+            }
           }
-        }
-        else
-        {
-          for (IndexType k = 0; k < NumOutputRegs; ++k)
+
+          // Horizontally add all accumulators.
+          for (IndexType n = 0; n < N; ++n)
           {
-            const IndexType idx = (bigBlock * NumOutputRegs + k);
-            output[idx] = vec_hadd(acc[k], biases[idx]);
+            if constexpr (OutputsPerPass % 4 == 0)
+            {
+              __m128i* outputvec = reinterpret_cast<__m128i*>(output[n]);
+              const __m128i* biasvec = reinterpret_cast<const __m128i*>(biases);
+
+              for (IndexType k = 0; k < OutputsPerPass; k += 4)
+              {
+                const IndexType idx = (bigBlock * NumOutputRegs + pass + k) / 4;
+                outputvec[idx] = vec_haddx4(acc[n][k+0], acc[n][k+1], acc[n][k+2], acc[n][k+3], biasvec[idx]);
+              }
+            }
+            else
+            {
+              for (IndexType k = 0; k < OutputsPerPass; ++k)
+              {
+                const IndexType idx = (bigBlock * NumOutputRegs + pass + k);
+                output[n][idx] = vec_hadd(acc[n][k], biases[idx]);
+              }
+            }
           }
         }
-      }
 
 # undef vec_setzero
 # undef vec_set_32
@@ -351,17 +436,15 @@ namespace Stockfish::Eval::NNUE::Layers {
 # undef vec_haddx4
 #else
       // Use old implementation for the other architectures.
-      affine_transform_non_ssse3<
-        InputDimensions,
-        PaddedInputDimensions,
-        OutputDimensions>(output, weights, biases, input);
+      for (IndexType n = 0; n < N; ++n)
+        affine_transform_non_ssse3<
+          InputDimensions,
+          PaddedInputDimensions,
+          OutputDimensions>(output[n], weights, biases, input[n]);
 
 #endif
-
-      return output;
     }
 
-   private:
     using BiasType = OutputType;
     using WeightType = std::int8_t;
 
@@ -452,8 +535,35 @@ namespace Stockfish::Eval::NNUE::Layers {
     // Forward propagation
     const OutputType* propagate(
         const TransformedFeatureType* transformedFeatures, char* buffer) const {
-      const auto input = previousLayer.propagate(
-        transformedFeatures, buffer + SelfBufferSize);
+      return forward(previousLayer.propagate(
+        transformedFeatures, buffer + SelfBufferSize), buffer);
+    }
+
+    // Forward propagation of a batch of inputs, one layer at a time for all of
+    // them. Input i is read from transformedFeatures + i * featureStride and
+    // uses buffer + i * bufferStride.
+    void propagate_batch(
+        const TransformedFeatureType* transformedFeatures, std::size_t featureStride,
+        char* buffer, std::size_t bufferStride, std::size_t count) const {
+      previousLayer.propagate_batch(
+        transformedFeatures, featureStride, buffer + SelfBufferSize, bufferStride, count);
+      for (std::size_t i = 0; i < count; ++i)
+        forward(previousLayer.batch_output(transformedFeatures + i * featureStride,
+                                           buffer + SelfBufferSize + i * bufferStride),
+                buffer + i * bufferStride);
+    }
+
+    // Output of one input of propagate_batch(), given the buffers it used
+    const OutputType* batch_output(
+        const TransformedFeatureType* /*transformedFeatures*/, char* buffer) const {
+      return reinterpret_cast<const OutputType*>(buffer);
+    }
+
+    // Layer below this one, to run and time the layers one by one
+    const PreviousLayer& previous_layer() const { return previousLayer; }
+
+    // Forward propagation of this layer only
+    const OutputType* forward(const InputType* input, char* buffer) const {
       const auto output = reinterpret_cast<OutputType*>(buffer);
 
 #if defined (USE_AVX2)
@@ -482,6 +592,37 @@ namespace Stockfish::Eval::NNUE::Layers {
       static_assert(InputDimensions % 8 == 0);
       static_assert(OutputDimensions % OutputSimdWidth == 0 || OutputDimensions == 1);
 
+#if defined (USE_AVX512)
+      // With AVX-512 the outputs are computed 16 at a time. A column of the
+      // scrambled weights holds the 4 weights of every output for 4 inputs,
+      // so it fills OutputDimensions / 16 registers.
+      if constexpr (OutputDimensions % 16 == 0)
+      {
+        constexpr IndexType NumChunks = InputDimensions / 4;
+        constexpr IndexType NumRegs = OutputDimensions / 16;
+
+        const auto input32 = reinterpret_cast<const std::int32_t*>(input);
+        const __m512i* biasvec = reinterpret_cast<const __m512i*>(biases);
+        __m512i acc[NumRegs];
+        for (IndexType k = 0; k < NumRegs; ++k)
+          acc[k] = biasvec[k];
+
+        for (IndexType i = 0; i < NumChunks; i += 2)
+        {
+          const __m512i in0 = _mm512_set1_epi32(input32[i + 0]);
+          const __m512i in1 = _mm512_set1_epi32(input32[i + 1]);
+          const auto col0 = reinterpret_cast<const __m512i*>(&weights[(i + 0) * OutputDimensions * 4]);
+          const auto col1 = reinterpret_cast<const __m512i*>(&weights[(i + 1) * OutputDimensions * 4]);
+          for (IndexType k = 0; k < NumRegs; ++k)
+            Simd::m512_add_dpbusd_epi32x2(acc[k], in0, col0[k], in1, col1[k]);
+        }
+
+        __m512i* outptr = reinterpret_cast<__m512i*>(output);
+        for (IndexType k = 0; k < NumRegs; ++k)
+          outptr[k] = acc[k];
+      }
+      else
+#endif
       if constexpr (OutputDimensions % OutputSimdWidth == 0)
       {
         constexpr IndexType NumChunks = InputDimensions / 4;
@@ -68,10 +68,54 @@ namespace Stockfish::Eval::NNUE::Layers {
     // Forward propagation
     const OutputType* propagate(
         const TransformedFeatureType* transformedFeatures, char* buffer) const {
-      const auto input = previousLayer.propagate(
-          transformedFeatures, buffer + SelfBufferSize);
+      return forward(previousLayer.propagate(
+        transformedFeatures, buffer + SelfBufferSize), buffer);
+    }
+
+    // Forward propagation of a batch of inputs, one layer at a time for all of
+    // them. Input i is read from transformedFeatures + i * featureStride and
+    // uses buffer + i * bufferStride.
+    void propagate_batch(
+        const TransformedFeatureType* transformedFeatures, std::size_t featureStride,
+        char* buffer, std::size_t bufferStride, std::size_t count) const {
+      previousLayer.propagate_batch(
+        transformedFeatures, featureStride, buffer + SelfBufferSize, bufferStride, count);
+      for (std::size_t i = 0; i < count; ++i)
+        forward(previousLayer.batch_output(transformedFeatures + i * featureStride,
+                                           buffer + SelfBufferSize + i * bufferStride),
+                buffer + i * bufferStride);
+    }
+
+    // Output of one input of propagate_batch(), given the buffers it used
+    const OutputType* batch_output(
+        const TransformedFeatureType* /*transformedFeatures*/, char* buffer) const {
+      return reinterpret_cast<const OutputType*>(buffer);
+    }
+
+    // Layer below this one, to run and time the layers one by one
+    const PreviousLayer& previous_layer() const { return previousLayer; }
+
+    // Forward propagation of this layer only
+    const OutputType* forward(const InputType* input, char* buffer) const {
       const auto output = reinterpret_cast<OutputType*>(buffer);
 
+  #if defined(USE_SSE41)
+      // The 8 outputs of the first hidden layer are too few for the loops below.
+      // They are packed into the low half of one register, whose high half and
+      // a second store give the zero padding of the affine transform above.
+      if constexpr (InputDimensions == 8 && PaddedOutputDimensions == 32) {
+        const __m128i Zero = _mm_setzero_si128();
+        const auto in = reinterpret_cast<const __m128i*>(input);
+        const auto out = reinterpret_cast<__m128i*>(output);
+        const __m128i words = _mm_srai_epi16(_mm_packs_epi32(
+            _mm_load_si128(&in[0]),
+            _mm_load_si128(&in[1])), WeightScaleBits);
+        _mm_store_si128(&out[0], _mm_max_epi8(_mm_packs_epi16(words, Zero), Zero));
+        _mm_store_si128(&out[1], Zero);
+        return output;
+      }
+  #endif
+
   #if defined(USE_AVX2)
       if constexpr (InputDimensions % SimdWidth == 0) {
         constexpr IndexType NumChunks = InputDimensions / SimdWidth;
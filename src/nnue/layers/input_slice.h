@@ -65,6 +65,18 @@ class InputSlice {
     return transformedFeatures + Offset;
   }
 
+  // Forward propagation of a batch of inputs, nothing to do
+  void propagate_batch(
+      const TransformedFeatureType* /*transformedFeatures*/, std::size_t /*featureStride*/,
+      char* /*buffer*/, std::size_t /*bufferStride*/, std::size_t /*count*/) const {
+  }
+
+  // Output of one input of propagate_batch()
+  const OutputType* batch_output(
+      const TransformedFeatureType* transformedFeatures, char* /*buffer*/) const {
+    return transformedFeatures + Offset;
+  }
+
  private:
 };
 
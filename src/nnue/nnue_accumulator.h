@@ -32,6 +32,27 @@ namespace Stockfish::Eval::NNUE {
     bool computed[2];
   };
 
+  // Incremented whenever a net is loaded, so that the cached accumulators
+  // computed with the previous net are discarded.
+  extern std::uint32_t NetGeneration;
+
+  // Per-thread refresh cache ("finny tables"). For every king square and
+  // perspective it keeps the accumulator of the last position refreshed with
+  // that king square, along with the piece bitboards of that position, so that
+  // a refresh only has to apply the pieces that differ from the cached board.
+  struct AccumulatorCache {
+
+    struct alignas(CacheLineSize) Entry {
+      std::int16_t accumulation[TransformedFeatureDimensions];
+      std::int32_t psqtAccumulation[PSQTBuckets];
+      Bitboard byColorBB[COLOR_NB];
+      Bitboard byTypeBB[PIECE_TYPE_NB];
+      std::uint32_t generation;
+    };
+
+    Entry entries[SQUARE_NB][COLOR_NB] = {};
+  };
+
 }  // namespace Stockfish::Eval::NNUE
 
 #endif // NNUE_ACCUMULATOR_H_INCLUDED
@@ -23,7 +23,9 @@
 
 #include "nnue_common.h"
 #include "nnue_architecture.h"
+#include "../thread.h"
 
+#include <algorithm> // std::find()
 #include <cstring> // std::memset()
 
 namespace Stockfish::Eval::NNUE {
@@ -214,10 +216,12 @@ namespace Stockfish::Eval::NNUE {
       return !stream.fail();
     }
 
-    // Convert input features
-    std::int32_t transform(const Position& pos, OutputType* output, int bucket) const {
-      update_accumulator(pos, WHITE);
-      update_accumulator(pos, BLACK);
+    // Convert input features. Refreshes go through the cache if one is given,
+    // which must not be used by another thread at the same time.
+    std::int32_t transform(const Position& pos, OutputType* output, int bucket,
+                           AccumulatorCache* cache = nullptr) const {
+      update_accumulator(pos, WHITE, cache);
+      update_accumulator(pos, BLACK, cache);
 
       const Color perspectives[2] = {pos.side_to_move(), ~pos.side_to_move()};
       const auto& accumulation = pos.state()->accumulator.accumulation;
@@ -364,7 +368,26 @@ namespace Stockfish::Eval::NNUE {
 
 
    private:
-    void update_accumulator(const Position& pos, const Color perspective) const {
+    // Drop the features found in both lists, which cancel each other out
+    template<typename IndexList>
+    static void cancel_changes(IndexList& removed, IndexList& added) {
+
+      for (std::size_t i = 0; i < removed.size(); )
+      {
+        auto it = std::find(added.begin(), added.end(), removed[i]);
+        if (it == added.end())
+        {
+          ++i;
+          continue;
+        }
+        *it = added[added.size() - 1];
+        added.resize(added.size() - 1);
+        removed[i] = removed[removed.size() - 1];
+        removed.resize(removed.size() - 1);
+      }
+    }
+
+    void update_accumulator(const Position& pos, const Color perspective, AccumulatorCache* cache) const {
 
       // The size must be enough to contain the largest possible update.
       // That might depend on the feature set and generally relies on the
@@ -399,6 +422,8 @@ namespace Stockfish::Eval::NNUE {
         if (next == nullptr)
           return;
 
+        pos.this_thread()->count(STAT_NNUE_UPDATES);
+
         // Update incrementally in two steps. First, we update the "next"
         // accumulator. Then, we update the current accumulator (pos.state()).
 
@@ -411,6 +436,11 @@ namespace Stockfish::Eval::NNUE {
           FeatureSet::append_changed_indices(
             ksq, st2, perspective, removed[1], added[1]);
 
+        // The plies between "next" and the current position are applied in a
+        // single pass, so a feature that one of them adds and a later one
+        // removes, as when a piece moves twice, need not be applied at all.
+        cancel_changes(removed[1], added[1]);
+
         // Mark the accumulators as computed.
         next->accumulator.computed[perspective] = true;
         pos.state()->accumulator.computed[perspective] = true;
@@ -529,9 +559,129 @@ namespace Stockfish::Eval::NNUE {
         }
   #endif
       }
+      else if (cache)
+      {
+        // Refresh the accumulator from the cached one of the same king square,
+        // applying only the pieces that differ from the cached board. Like the
+        // incremental updates this is exact, the 16 bit sums wrap both ways.
+        pos.this_thread()->count(STAT_NNUE_REFRESHES);
+        auto& accumulator = pos.state()->accumulator;
+        auto& entry = cache->entries[pos.square<KING>(perspective)][perspective];
+        accumulator.computed[perspective] = true;
+
+        if (entry.generation != NetGeneration)
+        {
+          std::memcpy(entry.accumulation, biases, HalfDimensions * sizeof(BiasType));
+          std::memset(entry.psqtAccumulation, 0, sizeof(entry.psqtAccumulation));
+          std::memset(entry.byColorBB, 0, sizeof(entry.byColorBB));
+          std::memset(entry.byTypeBB, 0, sizeof(entry.byTypeBB));
+          entry.generation = NetGeneration;
+        }
+
+        IndexList removed, added;
+        FeatureSet::append_board_changes(pos, perspective, entry.byColorBB, entry.byTypeBB, removed, added);
+
+  #ifdef VECTOR
+        for (IndexType j = 0; j < HalfDimensions / TileHeight; ++j)
+        {
+          auto entryTile = reinterpret_cast<vec_t*>(&entry.accumulation[j * TileHeight]);
+          for (IndexType k = 0; k < NumRegs; ++k)
+            acc[k] = vec_load(&entryTile[k]);
+
+          for (const auto index : removed)
+          {
+            const IndexType offset = HalfDimensions * index + j * TileHeight;
+            auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
+            for (IndexType k = 0; k < NumRegs; ++k)
+              acc[k] = vec_sub_16(acc[k], column[k]);
+          }
+
+          for (const auto index : added)
+          {
+            const IndexType offset = HalfDimensions * index + j * TileHeight;
+            auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
+            for (IndexType k = 0; k < NumRegs; ++k)
+              acc[k] = vec_add_16(acc[k], column[k]);
+          }
+
+          auto accTile = reinterpret_cast<vec_t*>(
+              &accumulator.accumulation[perspective][j * TileHeight]);
+          for (IndexType k = 0; k < NumRegs; ++k)
+          {
+            vec_store(&entryTile[k], acc[k]);
+            vec_store(&accTile[k], acc[k]);
+          }
+        }
+
+        for (IndexType j = 0; j < PSQTBuckets / PsqtTileHeight; ++j)
+        {
+          auto entryTilePsqt = reinterpret_cast<psqt_vec_t*>(&entry.psqtAccumulation[j * PsqtTileHeight]);
+          for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+            psqt[k] = vec_load_psqt(&entryTilePsqt[k]);
+
+          for (const auto index : removed)
+          {
+            const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
+            auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
+            for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+              psqt[k] = vec_sub_psqt_32(psqt[k], columnPsqt[k]);
+          }
+
+          for (const auto index : added)
+          {
+            const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
+            auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
+            for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+              psqt[k] = vec_add_psqt_32(psqt[k], columnPsqt[k]);
+          }
+
+          auto accTilePsqt = reinterpret_cast<psqt_vec_t*>(
+            &accumulator.psqtAccumulation[perspective][j * PsqtTileHeight]);
+          for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+          {
+            vec_store_psqt(&entryTilePsqt[k], psqt[k]);
+            vec_store_psqt(&accTilePsqt[k], psqt[k]);
+          }
+        }
+
+  #else
+        for (const auto index : removed)
+        {
+          const IndexType offset = HalfDimensions * index;
+
+          for (IndexType j = 0; j < HalfDimensions; ++j)
+            entry.accumulation[j] -= weights[offset + j];
+
+          for (std::size_t k = 0; k < PSQTBuckets; ++k)
+            entry.psqtAccumulation[k] -= psqtWeights[index * PSQTBuckets + k];
+        }
+
+        for (const auto index : added)
+        {
+          const IndexType offset = HalfDimensions * index;
+
+          for (IndexType j = 0; j < HalfDimensions; ++j)
+            entry.accumulation[j] += weights[offset + j];
+
+          for (std::size_t k = 0; k < PSQTBuckets; ++k)
+            entry.psqtAccumulation[k] += psqtWeights[index * PSQTBuckets + k];
+        }
+
+        std::memcpy(accumulator.accumulation[perspective], entry.accumulation,
+            HalfDimensions * sizeof(BiasType));
+        std::memcpy(accumulator.psqtAccumulation[perspective], entry.psqtAccumulation,
+            PSQTBuckets * sizeof(PSQTWeightType));
+  #endif
+
+        for (Color c : { WHITE, BLACK })
+          entry.byColorBB[c] = pos.pieces(c);
+        for (PieceType pt = PAWN; pt <= KING; ++pt)
+          entry.byTypeBB[pt] = pos.pieces(pt);
+      }
       else
       {
         // Refresh the accumulator
+        pos.this_thread()->count(STAT_NNUE_REFRESHES);
         auto& accumulator = pos.state()->accumulator;
         accumulator.computed[perspective] = true;
         IndexList active;
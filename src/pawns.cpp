@@ -18,6 +18,8 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>   // For std::memcpy
+#include <iostream>
 
 #include "bitboard.h"
 #include "pawns.h"
@@ -197,6 +199,67 @@ namespace {
     return score;
   }
 
+  // SharedEntry is a slot of the optional pawn hash table shared by all the
+  // threads (see the "Pawn Hash" option). It holds the thread independent part
+  // of an Entry and is read and written without locks: 'check' is the pawn key
+  // xor'ed with all the data words, so a slot torn by concurrent writers fails
+  // the check and is treated as a miss.
+  struct alignas(64) SharedEntry {
+    Key check;
+    uint64_t data[7];
+  };
+
+  static_assert(sizeof(SharedEntry) == 64, "SharedEntry should fill one cache line");
+
+  SharedEntry* sharedTable;
+  size_t sharedCount;
+
+  Key check_of(Key key, const uint64_t* data) {
+
+    for (int i = 0; i < 7; ++i)
+        key ^= data[i];
+    return key;
+  }
+
+  // load_shared() fills the entry from the shared table, if the pawn key is
+  // found there. The king safety cache is per thread and is reset.
+  bool load_shared(const Position& pos, Key key, Pawns::Entry* e) {
+
+    SharedEntry se;
+    std::memcpy(&se, &sharedTable[mul_hi64(key, sharedCount)], sizeof(se));
+
+    if (se.check != check_of(key, se.data))
+        return false;
+
+    e->key = key;
+    e->scores[WHITE]          = Score(int32_t(uint32_t(se.data[0])));
+    e->scores[BLACK]          = Score(int32_t(uint32_t(se.data[0] >> 32)));
+    e->passedPawns[WHITE]     = se.data[1];
+    e->passedPawns[BLACK]     = se.data[2];
+    e->pawnAttacksSpan[WHITE] = se.data[3];
+    e->pawnAttacksSpan[BLACK] = se.data[4];
+    e->blockedCount           = int(se.data[5]);
+    e->pawnAttacks[WHITE]     = pawn_attacks_bb<WHITE>(pos.pieces(WHITE, PAWN));
+    e->pawnAttacks[BLACK]     = pawn_attacks_bb<BLACK>(pos.pieces(BLACK, PAWN));
+    e->kingSquares[WHITE]     = e->kingSquares[BLACK] = SQ_NONE;
+    return true;
+  }
+
+  void store_shared(Key key, const Pawns::Entry* e) {
+
+    SharedEntry se;
+    se.data[0] = uint32_t(e->scores[WHITE]) | uint64_t(uint32_t(e->scores[BLACK])) << 32;
+    se.data[1] = e->passedPawns[WHITE];
+    se.data[2] = e->passedPawns[BLACK];
+    se.data[3] = e->pawnAttacksSpan[WHITE];
+    se.data[4] = e->pawnAttacksSpan[BLACK];
+    se.data[5] = uint64_t(e->blockedCount);
+    se.data[6] = 0;
+    se.check = check_of(key, se.data);
+
+    std::memcpy(&sharedTable[mul_hi64(key, sharedCount)], &se, sizeof(se));
+  }
+
 } // namespace
 
 namespace Pawns {
@@ -209,21 +272,69 @@ namespace Pawns {
 
 Entry* probe(const Position& pos) {
 
+  Thread* th = pos.this_thread();
   Key key = pos.pawn_key();
-  Entry* e = pos.this_thread()->pawnsTable[key];
+  Entry* e = th->pawnsTable[key];
+
+  th->count(STAT_PAWN_PROBES);
 
   if (e->key == key)
       return e;
 
+  // When the shared table is enabled the per-thread table acts as a private
+  // front cache: entries handed out by probe() also cache the king safety of
+  // the thread, so they cannot be shared themselves.
+  if (sharedTable)
+  {
+      if (load_shared(pos, key, e))
+      {
+          th->count(STAT_PAWN_SHARED_HITS);
+          return e;
+      }
+  }
+
+  th->count(STAT_PAWN_MISSES);
+
   e->key = key;
   e->blockedCount = 0;
   e->scores[WHITE] = evaluate<WHITE>(pos, e);
   e->scores[BLACK] = evaluate<BLACK>(pos, e);
 
+  if (sharedTable)
+      store_shared(key, e);
+
   return e;
 }
 
 
+/// Pawns::resize_shared() sets the size in MB of the pawn hash table shared
+/// by all the threads. Zero frees it, and every thread then only uses its own
+/// table. The search, which probes the table, is finished first.
+
+void resize_shared(size_t mbSize) {
+
+  Threads.main()->wait_for_search_finished();
+
+  aligned_large_pages_free(sharedTable);
+  sharedTable = nullptr;
+  sharedCount = mbSize * 1024 * 1024 / sizeof(SharedEntry);
+
+  if (!sharedCount)
+      return;
+
+  sharedTable = static_cast<SharedEntry*>(aligned_large_pages_alloc(sharedCount * sizeof(SharedEntry)));
+  if (!sharedTable)
+  {
+      std::cerr << "Failed to allocate " << mbSize
+                << "MB for the shared pawn hash table." << std::endl;
+      exit(EXIT_FAILURE);
+  }
+
+  // A zeroed slot passes the check only for a zero pawn key
+  std::memset(static_cast<void*>(sharedTable), 0, sharedCount * sizeof(SharedEntry));
+}
+
+
 /// Entry::evaluate_shelter() calculates the shelter bonus and the storm
 /// penalty for a king, looking at the king file and the two closest files.
 
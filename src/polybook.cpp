@@ -20,7 +20,15 @@
 #include "uci.h"
 #include "movegen.h"
 #include "thread.h"
+#include "experience.h"
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <queue>
+#include <sstream>
+#include <unordered_set>
 #include "misc.h"
 #include <sys/timeb.h>
 
@@ -363,16 +371,16 @@ namespace
         return a;
     }
 
-    void byteswap_polyhash(PolyHash* ph)
-    {
-        if (is_little_endian())
-        {
-            ph->key = swap_uint64(ph->key);
-            ph->move = swap_uint16(ph->move);
-            ph->weight = swap_uint16(ph->weight);
-            ph->learn = swap_uint32(ph->learn);
-        }
-    }
+    // Book entries are stored big-endian and are left that way in the mapped
+    // file, so the fields are converted whenever they are read
+    uint16_t from_big_endian(uint16_t d) { return is_little_endian() ? swap_uint16(d) : d; }
+    uint32_t from_big_endian(uint32_t d) { return is_little_endian() ? swap_uint32(d) : d; }
+    uint64_t from_big_endian(uint64_t d) { return is_little_endian() ? swap_uint64(d) : d; }
+
+    // Number of book entries per key index sample. The samples of a 4 GB book
+    // take 512 KB and stay in cache, and building them touches only one page
+    // out of sixteen of the mapped file
+    constexpr int KeyIndexStride = 4096;
 }
 
 PolyBook::PolyBook()
@@ -380,92 +388,114 @@ PolyBook::PolyBook()
     keycount = 0;
     polyhash = NULL;
     enabled = false;
-
-    index_first = index_best = index_rand = 0;
-    index_count = index_weight_count = 0;
-}
-
-PolyBook::~PolyBook()
-{
-    if (polyhash != NULL)
-        delete[]polyhash;
 }
 
 void PolyBook::init(const std::string& bookfile)
 {
     enabled = false;
+
+    //The book is mapped read-only: all engine processes using the same book
+    //share a single copy of it in the OS page cache
+    bookFile.unmap();
+    polyhash = NULL;
+    keycount = 0;
+    keyIndex.clear();
+
     if (bookfile.empty() || bookfile == "<empty>")
         return;
 
-    FILE *fpt = fopen(bookfile.c_str(), "rb");
-    if (fpt == NULL)
+    if (!bookFile.map(bookfile, false))
     {
         sync_cout << "info string Could not open " << bookfile << sync_endl;
         return;
     }
 
-    if (polyhash)
-    {
-        free(polyhash);
-        polyhash = NULL;
-    }
+    keycount = bookFile.size() / sizeof(PolyHash);
+    polyhash = reinterpret_cast<const PolyHash*>(bookFile.data());
 
-    fseek(fpt, 0L, SEEK_END);
-    size_t filesize = (size_t)ftell(fpt);
-    fseek(fpt, 0L, SEEK_SET);
+    //Sample every KeyIndexStride-th key, so that a probe only has to search
+    //the entries between two samples instead of the whole book
+    keyIndex.reserve(keycount / KeyIndexStride + 1);
+    for (int i = 0; i < keycount; i += KeyIndexStride)
+        keyIndex.push_back(entry_key(i));
 
-    keycount = filesize / 16;
-    polyhash = (PolyHash *)malloc(filesize);
-    if (!polyhash)
-    {
-        sync_cout << "info string Memory allocation failed" << bookfile << sync_endl;
-        return;
-    }
+    sync_cout << "info string Book loaded: " << bookfile << sync_endl;
 
-    size_t readSize = fread(polyhash, 1, filesize, fpt);
-    fclose(fpt);
+    enabled = true;
+}
 
-    if (readSize != filesize)
+Move PolyBook::probe(Position& pos, bool bestBookMove)
+{
+    vector<PolyBookEntry> entries = probe_all(pos);
+    if (entries.empty())
+        return MOVE_NONE;
+
+    size_t best = 0;
+    uint32_t weightCount = 0;
+    for (size_t i = 0; i < entries.size(); ++i)
     {
-        free(polyhash);
-        polyhash = NULL;
+        weightCount += entries[i].weight;
+        if (entries[i].weight > entries[best].weight)
+            best = i;
+    }
 
-        sync_cout << "info string Could not read " << bookfile << sync_endl;
-        return;
+    //Pick a move with a probability proportional to its weight
+    size_t idx = best;
+    if (!bestBookMove && entries.size() > 1 && weightCount)
+    {
+        uint32_t randPos = rng.rand<uint32_t>() % weightCount;
+        for (idx = 0; randPos >= entries[idx].weight; ++idx)
+            randPos -= entries[idx].weight;
     }
 
-    for (int i = 0; i<keycount; i++)
-        byteswap_polyhash(&polyhash[i]);
+    Move m = entries[idx].move;
+    if (entries.size() == 1 || !check_draw(pos, m))
+        return m;
 
-    sync_cout << "info string Book loaded: " << bookfile << sync_endl;
+    m = entries[idx == 0 ? 1 : 0].move;
+    if (!check_draw(pos, m))
+        return m;
 
-    enabled = true;
+    return MOVE_NONE;
 }
 
-Move PolyBook::probe(Position& pos, bool bestBookMove)
+//probe_all() returns all the book moves of the position in book order. It only
+//reads the book, so it can be called concurrently by any number of threads
+vector<PolyBookEntry> PolyBook::probe_all(const Position& pos) const
 {
+    vector<PolyBookEntry> entries;
     if (!enabled)
-        return MOVE_NONE;
+        return entries;
 
     Key key = polyglot_key(pos);
-    int n = find_first_key(key);
-    if (n < 1)
-        return MOVE_NONE;
-
-    int idx = bestBookMove || n == 1 ? index_best : index_rand;
-    Move m = pg_move_to_sf_move(pos, polyhash[idx].move);
-    if (n == 1 || !check_draw(pos, m))
-        return m;
-
-    if (n > 1)
+    for (int i = lower_bound_key(key); i < keycount && entry_key(i) == key; ++i)
     {
-        idx = idx == index_first ? index_first + 1 : index_first;
-        m = pg_move_to_sf_move(pos, polyhash[idx].move);
-        if (!check_draw(pos, m))
-            return m;
+        Move m = pg_move_to_sf_move(pos, entry_move(i));
+        if (m != MOVE_NONE)
+            entries.push_back({ m, entry_weight(i), entry_learn(i) });
     }
 
-    return MOVE_NONE;
+    return entries;
+}
+
+uint64_t PolyBook::entry_key(int idx) const
+{
+    return from_big_endian(polyhash[idx].key);
+}
+
+uint16_t PolyBook::entry_move(int idx) const
+{
+    return from_big_endian(polyhash[idx].move);
+}
+
+uint16_t PolyBook::entry_weight(int idx) const
+{
+    return from_big_endian(polyhash[idx].weight);
+}
+
+uint32_t PolyBook::entry_learn(int idx) const
+{
+    return from_big_endian(polyhash[idx].learn);
 }
 
 Key PolyBook::polyglot_key(const Position & pos)
@@ -512,13 +542,16 @@ Key PolyBook::polyglot_key(const Position & pos)
 // bit  6-11: origin square (from 0 to 63)
 // bit 12-13: promotion piece type - 2 (from KNIGHT-2 to QUEEN-2)
 // bit 14-15: special move flag: promotion (1), en passant (2), castling (3)
-Move PolyBook::pg_move_to_sf_move(const Position & pos, unsigned short pg_move)
+Move PolyBook::pg_move_to_sf_move(const Position & pos, unsigned short pg_move) const
 {
     Move move = Move(pg_move);
       
     int pt = (move >> 12) & 7;
     if (pt)
-        return make<PROMOTION>(from_sq(move), to_sq(move), PieceType(pt + 1));
+    {
+        move = make<PROMOTION>(from_sq(move), to_sq(move), PieceType(pt + 1));
+        return MoveList<LEGAL>(pos).contains(move) ? move : MOVE_NONE;
+    }
   
     // Add 'special move' flags and verify it is legal
     for (const auto& m : MoveList<LEGAL>(pos))
@@ -530,101 +563,697 @@ Move PolyBook::pg_move_to_sf_move(const Position & pos, unsigned short pg_move)
     return MOVE_NONE;
 }
 
-int PolyBook::find_first_key(uint64_t key)
+int PolyBook::lower_bound_key(uint64_t key) const
 {
-    index_first = -1;
-    index_count = 0;
-    index_weight_count = 0;
-    index_best = -1;
-    index_rand = -1;
+    //Find the first sample not less than the key. The key can only be found
+    //after the previous sample and up to this one
+    size_t sample = lower_bound(keyIndex.begin(), keyIndex.end(), key) - keyIndex.begin();
 
-    int start = 0;
-    int end = keycount;
+    int start = sample == 0 ? 0 : int(sample - 1) * KeyIndexStride + 1;
+    int end = sample == keyIndex.size() ? keycount : int(sample) * KeyIndexStride + 1;
 
-    for (;;)
+    //Binary search of the first entry not less than the key
+    while (start < end)
     {
-        int mid = (end + start) / 2;
+        int mid = start + (end - start) / 2;
 
-        if (polyhash[mid].key < key)
-            start = mid;
+        if (entry_key(mid) < key)
+            start = mid + 1;
         else
+            end = mid;
+    }
+
+    return start;
+}
+
+bool PolyBook::check_draw(Position &pos, Move m)
+{
+    StateInfo st;
+
+    pos.do_move(m, st, pos.gives_check(m));
+    bool draw = pos.is_draw(pos.game_ply());
+    pos.undo_move(m);
+
+    return draw;
+}
+
+
+
+namespace
+{
+    const char* StartFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+    //Walks the positions reachable from the start position through the moves
+    //returned by expand(pos, task), one ply at a time. The positions of a ply
+    //are split into threadCount tasks run on the thread pool, and each position
+    //is expanded once, however many move orders lead to it. plyDone(ply) is
+    //called once all the tasks have finished the ply, so the outputs of the
+    //tasks can be collected in the same order whatever the number of threads.
+    template<typename Expand, typename PlyDone>
+    void walk_tree(int maxPly, size_t threadCount, Expand expand, PlyDone plyDone)
+    {
+        const bool chess960 = Options["UCI_Chess960"];
+
+        vector<string> frontier = { StartFEN };
+        unordered_set<Key> visited;
+
         {
-            if (polyhash[mid].key > key)
-                end = mid;
-            else
+            StateInfo st;
+            Position pos;
+            visited.insert(pos.set(frontier[0], chess960, &st, Threads.main()).key());
+        }
+
+        for (int ply = 0; ply < maxPly && !frontier.empty(); ++ply)
+        {
+            vector<vector<pair<Key, string>>> children(threadCount);
+
+            Threads.parallel_for(threadCount, [&](size_t idx) {
+
+                const size_t begin = frontier.size() * idx / threadCount,
+                             end   = frontier.size() * (idx + 1) / threadCount;
+
+                for (size_t i = begin; i < end; ++i)
+                {
+                    StateInfo st;
+                    Position pos;
+                    pos.set(frontier[i], chess960, &st, Threads.main());
+
+                    vector<Move> moves = expand(pos, idx);
+                    if (ply + 1 == maxPly)
+                        continue;
+
+                    for (Move m : moves)
+                    {
+                        StateInfo st2;
+                        pos.do_move(m, st2);
+                        children[idx].emplace_back(pos.key(), pos.fen());
+                        pos.undo_move(m);
+                    }
+                }
+            });
+
+            plyDone(ply);
+
+            //Collect the new positions in frontier order
+            frontier.clear();
+            for (auto& shard : children)
+                for (auto& child : shard)
+                    if (visited.insert(child.first).second)
+                        frontier.push_back(std::move(child.second));
+        }
+    }
+
+    //Orders book entries by key, then by move
+    bool entry_less(const PolyHash& a, const PolyHash& b)
+    {
+        return a.key < b.key || (a.key == b.key && a.move < b.move);
+    }
+
+    //Collects book entries and writes them as a sorted polyglot book. The
+    //entries are sorted in parallel in runs of bounded size, which are spilled
+    //to temporary files next to the book and merged into it at the end. The
+    //weights of the same move of a position are added, moves with no weight
+    //are dropped and the moves of a position are written heaviest first.
+    //The book is written to a temporary file which replaces the target only
+    //once complete, so the target can also be one of the inputs.
+    class BookWriter
+    {
+    public:
+        explicit BookWriter(const string& fname) : bookFile(fname), threadCount(Threads.size() + 1) {}
+
+        ~BookWriter()
+        {
+            for (const string& run : runs)
+                remove(run.c_str());
+        }
+
+        //Entries are given in host byte order
+        void add(const PolyHash& e)
+        {
+            entries.push_back(e);
+            if (entries.size() >= RunEntries)
+                spill();
+        }
+
+        bool finish();
+
+        size_t positions = 0;
+        size_t moves = 0;
+
+    private:
+        //Memory used by the entries of a run
+        static constexpr size_t RunEntries = size_t(512) * 1024 * 1024 / sizeof(PolyHash);
+        static constexpr size_t BufferEntries = 64 * 1024;
+
+        void sort_entries();
+        void spill();
+        void put(const PolyHash& e);
+        void flush_position();
+        void flush_output();
+
+        string bookFile;
+        size_t threadCount;
+        vector<PolyHash> entries;
+        vector<string> runs;
+        bool failed = false;
+
+        ofstream out;
+        vector<PolyHash> position;
+        vector<PolyHash> output;
+    };
+
+    //Sorts the entries on the thread pool: each worker sorts a slice, then
+    //neighbouring slices are merged in parallel until one is left
+    void BookWriter::sort_entries()
+    {
+        vector<size_t> bounds;
+        for (size_t i = 0; i <= threadCount; ++i)
+            bounds.push_back(entries.size() * i / threadCount);
+
+        auto first = entries.begin();
+
+        Threads.parallel_for(threadCount, [&](size_t i) { sort(first + bounds[i], first + bounds[i + 1], entry_less); });
+
+        for (size_t width = 1; width < threadCount; width *= 2)
+            Threads.parallel_for((threadCount + width - 1) / (2 * width), [&](size_t n) {
+                const size_t i = n * 2 * width;
+                inplace_merge(first + bounds[i], first + bounds[i + width],
+                              first + bounds[min(i + 2 * width, threadCount)], entry_less);
+            });
+    }
+
+    void BookWriter::spill()
+    {
+        sort_entries();
+
+        string run = bookFile + ".run" + to_string(runs.size());
+        ofstream f(run, ios::out | ios::binary | ios::trunc);
+        f.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(PolyHash));
+
+        runs.push_back(run);
+        failed |= !f;
+        entries.clear();
+    }
+
+    void BookWriter::put(const PolyHash& e)
+    {
+        if (!position.empty() && position.back().key != e.key)
+            flush_position();
+
+        if (!position.empty() && position.back().move == e.move)
+        {
+            position.back().weight = uint16_t(min(uint32_t(position.back().weight) + e.weight, uint32_t(0xFFFF)));
+            position.back().learn = max(position.back().learn, e.learn);
+        }
+        else
+            position.push_back(e);
+    }
+
+    void BookWriter::flush_position()
+    {
+        position.erase(remove_if(position.begin(), position.end(), [](const PolyHash& e) { return !e.weight; }), position.end());
+        stable_sort(position.begin(), position.end(), [](const PolyHash& a, const PolyHash& b) { return a.weight > b.weight; });
+
+        positions += !position.empty();
+        moves += position.size();
+
+        for (const PolyHash& e : position)
+        {
+            output.push_back({ from_big_endian(e.key), from_big_endian(e.move), from_big_endian(e.weight), from_big_endian(e.learn) });
+            if (output.size() >= BufferEntries)
+                flush_output();
+        }
+
+        position.clear();
+    }
+
+    void BookWriter::flush_output()
+    {
+        out.write(reinterpret_cast<const char*>(output.data()), output.size() * sizeof(PolyHash));
+        output.clear();
+    }
+
+    bool BookWriter::finish()
+    {
+        const string tempFile = bookFile + ".tmp";
+        out.open(tempFile, ios::out | ios::binary | ios::trunc);
+        if (!out.is_open())
+        {
+            sync_cout << "info string Could not open " << tempFile << " for writing" << sync_endl;
+            return false;
+        }
+
+        if (runs.empty())
+        {
+            sort_entries();
+            for (const PolyHash& e : entries)
+                put(e);
+        }
+        else
+        {
+            if (!entries.empty())
+                spill();
+
+            //Merge the runs, reading each one through a small buffer
+            struct Run {
+                ifstream in;
+                vector<PolyHash> buffer;
+                size_t next = 0;
+
+                bool fill() {
+                    buffer.resize(BufferEntries);
+                    in.read(reinterpret_cast<char*>(buffer.data()), BufferEntries * sizeof(PolyHash));
+                    buffer.resize(size_t(in.gcount()) / sizeof(PolyHash));
+                    next = 0;
+                    return !buffer.empty();
+                }
+            };
+
+            vector<Run> readers(runs.size());
+            auto greater = [&](size_t a, size_t b) {
+                return entry_less(readers[b].buffer[readers[b].next], readers[a].buffer[readers[a].next]);
+            };
+            priority_queue<size_t, vector<size_t>, decltype(greater)> heap(greater);
+
+            for (size_t i = 0; i < runs.size(); ++i)
             {
-                start = max(mid - 4, 0);
-                end = min(mid + 4, keycount);
+                readers[i].in.open(runs[i], ios::in | ios::binary);
+                if (readers[i].fill())
+                    heap.push(i);
             }
+
+            while (!heap.empty())
+            {
+                size_t i = heap.top();
+                heap.pop();
+
+                put(readers[i].buffer[readers[i].next]);
+
+                if (++readers[i].next < readers[i].buffer.size() || readers[i].fill())
+                    heap.push(i);
+            }
+        }
+
+        entries.clear();
+        flush_position();
+        flush_output();
+        out.close();
+
+        if (failed || !out)
+        {
+            remove(tempFile.c_str());
+            sync_cout << "info string Could not write " << bookFile << sync_endl;
+            return false;
         }
 
-        if (end - start < 9)
-            break;
+        remove(bookFile.c_str());
+        return rename(tempFile.c_str(), bookFile.c_str()) == 0;
     }
+}
+
+//Polyglot move encoding of a move, see pg_move_to_sf_move()
+uint16_t PolyBook::sf_move_to_pg_move(Move m)
+{
+    uint16_t pgMove = uint16_t(m & 0xFFF);
+    if (type_of(m) == PROMOTION)
+        pgMove |= uint16_t((promotion_type(m) - 1) << 12);
 
-    for (int i = start; i < end; i++)
+    return pgMove;
+}
+
+//export_tree() implements the book_export command, which writes every position
+//reachable through the book moves within the given number of plies from the
+//start position:
+//
+//  book_export <book> <output> <plies>
+//
+//The output is an experience file if its name ends with .exp, otherwise an EPD
+//file with the book moves of each position in a c0 operation as move:weight:learn.
+//Experience entries get the weight of the book move as count, value 0 and the
+//minimum experience depth, so that any real analysis of the move replaces them.
+//The output is the same whatever the number of threads.
+void PolyBook::export_tree(int argc, char* argv[])
+{
+    if (argc < 3 || atoi(argv[2]) <= 0)
     {
-        if (key == polyhash[i].key)
+        sync_cout << "info string Error : Incorrect book_export command" << sync_endl;
+        sync_cout << "info string Syntax: book_export <book> <output> <plies>" << sync_endl;
+        return;
+    }
+
+    const string bookfile = Utility::map_path(Utility::unquote(argv[0]));
+    const string outfile = Utility::map_path(Utility::unquote(argv[1]));
+    const int maxPly = atoi(argv[2]);
+    const bool toExp = outfile.size() > 4 && outfile.compare(outfile.size() - 4, 4, ".exp") == 0;
+    const bool chess960 = Options["UCI_Chess960"];
+
+    PolyBook book;
+    book.init(bookfile);
+    if (!book.enabled)
+        return;
+
+    fstream out;
+    if (toExp ? !Experience::open_journal(out, outfile) : (out.open(outfile, ios::out | ios::trunc), !out.is_open()))
+    {
+        sync_cout << "info string Could not open " << outfile << " for writing" << sync_endl;
+        return;
+    }
+
+    sync_cout << "\nExporting book tree: " << bookfile
+              << "\nOutput file: " << outfile << " (" << (toExp ? "experience" : "EPD") << ")"
+              << "\nPlies: " << maxPly << "\n" << sync_endl;
+
+    //Output of one thread
+    struct Shard {
+        string output;
+        size_t positions = 0;
+        size_t moves = 0;
+    };
+
+    const TimePoint start = now();
+    const size_t threadCount = Threads.size() + 1;
+    vector<Shard> shards(threadCount);
+    size_t positions = 0, moves = 0;
+
+    auto expand = [&](Position& pos, size_t idx) {
+
+        Shard& shard = shards[idx];
+        vector<PolyBookEntry> entries = book.probe_all(pos);
+        vector<Move> bookMoves;
+
+        if (entries.empty())
+            return bookMoves;
+
+        ++shard.positions;
+        shard.moves += entries.size();
+
+        if (toExp)
+            for (const PolyBookEntry& e : entries)
+            {
+                Experience::Current::ExpEntry exp(pos.key(), e.move, VALUE_ZERO, EXP_MIN_DEPTH, max(e.weight, uint16_t(1)));
+                shard.output.append(reinterpret_cast<const char*>(&exp), sizeof(exp));
+            }
+        else
         {
-            index_first = i;
-            while ((index_first>0) && (key == polyhash[index_first - 1].key))
-                index_first--;
-            return get_key_data();
+            //EPD has only the first four fields of the FEN
+            const string fen = pos.fen();
+            shard.output += fen.substr(0, fen.rfind(' ', fen.rfind(' ') - 1)) + " c0 \"";
+
+            for (size_t j = 0; j < entries.size(); ++j)
+                shard.output += (j ? " " : "") + UCI::move(entries[j].move, chess960)
+                              + ":" + to_string(entries[j].weight) + ":" + to_string(entries[j].learn);
+
+            shard.output += "\";\n";
         }
+
+        for (const PolyBookEntry& e : entries)
+            bookMoves.push_back(e.move);
+
+        return bookMoves;
+    };
+
+    auto plyDone = [&](int ply) {
+
+        for (Shard& shard : shards)
+        {
+            out.write(shard.output.data(), shard.output.size());
+            positions += shard.positions;
+            moves += shard.moves;
+            shard = Shard();
+        }
+
+        sync_cout << "info string Ply " << ply + 1 << ": " << positions << " positions, "
+                  << moves << " moves" << sync_endl;
+    };
+
+    walk_tree(maxPly, threadCount, expand, plyDone);
+
+    out.close();
+
+    sync_cout << "info string Book tree exported: " << positions << " positions, " << moves
+              << " moves in " << now() - start << " ms" << (out ? "" : ", write failed") << sync_endl;
+}
+
+//build_from_exp() implements the book_from_exp command, which builds a polyglot
+//book from the positions reachable through experience moves:
+//
+//  book_from_exp <experience> <book> <plies> [min depth]
+//
+//The experience file becomes the current experience file. A move is taken
+//into the book when the experience book would play it: its depth is at least
+//min depth (default: Experience Book Min Depth) and its quality is positive
+//and not a likely draw. The quality is the weight of the move in the book.
+void PolyBook::build_from_exp(int argc, char* argv[])
+{
+    if (argc < 3 || atoi(argv[2]) <= 0)
+    {
+        sync_cout << "info string Error : Incorrect book_from_exp command" << sync_endl;
+        sync_cout << "info string Syntax: book_from_exp <experience> <book> <plies> [min depth]" << sync_endl;
+        return;
     }
 
-    return -1;
+    const string bookfile = Utility::map_path(Utility::unquote(argv[1]));
+    const int maxPly = atoi(argv[2]);
+    const Depth minDepth = argc >= 4 ? max((Depth)atoi(argv[3]), EXP_MIN_DEPTH) : (Depth)(int)Options["Experience Book Min Depth"];
+    const int evalImportance = (int)Options["Experience Book Eval Importance"];
+
+    Options["Experience Enabled"] = string("true");
+    Options["Experience File"] = Utility::unquote(argv[0]);
+    Experience::wait_for_loading_finished();
+
+    sync_cout << "\nBuilding book from experience: " << Options["Experience File"]
+              << "\nBook file: " << bookfile
+              << "\nPlies: " << maxPly << ", min depth: " << minDepth << "\n" << sync_endl;
+
+    const TimePoint start = now();
+    const size_t threadCount = Threads.size() + 1;
+    vector<vector<PolyHash>> shards(threadCount);
+    BookWriter writer(bookfile);
+
+    auto expand = [&](Position& pos, size_t idx) {
+
+        vector<Move> expMoves;
+        const Key key = polyglot_key(pos);
+
+        for (const Experience::ExpEntryEx* exp = Experience::probe(pos.key()); exp; exp = exp->next())
+        {
+            if (exp->depth < minDepth || !pos.pseudo_legal(exp->move) || !pos.legal(exp->move))
+                continue;
+
+            pair<int, bool> q = exp->quality(pos, evalImportance);
+            if (q.first <= 0 || q.second)
+                continue;
+
+            shards[idx].push_back({ key, sf_move_to_pg_move(exp->move), uint16_t(min(q.first, 0xFFFF)), 0 });
+            expMoves.push_back(exp->move);
+        }
+
+        return expMoves;
+    };
+
+    auto plyDone = [&](int ply) {
+
+        size_t added = 0;
+        for (vector<PolyHash>& shard : shards)
+        {
+            for (const PolyHash& e : shard)
+                writer.add(e);
+
+            added += shard.size();
+            shard.clear();
+        }
+
+        sync_cout << "info string Ply " << ply + 1 << ": " << added << " moves" << sync_endl;
+    };
+
+    walk_tree(maxPly, threadCount, expand, plyDone);
+
+    if (writer.finish())
+        sync_cout << "info string Book saved: " << writer.positions << " positions, " << writer.moves
+                  << " moves in " << now() - start << " ms" << sync_endl;
 }
 
-int PolyBook::get_key_data()
+//build_from_pgn() implements the book_from_pgn command, which builds a polyglot
+//book from the games of a compact PGN file (see Experience::convert_compact_pgn):
+//
+//  book_from_pgn <compact pgn> <book> [plies]
+//
+//The first plies (default: 40) of every game are taken into the book. As in
+//PolyGlot, a move gets a weight of 2 for a win and 1 for a draw of the side
+//which played it; moves of lost games only add a position to the book when the
+//move has also been played in other games. Games are replayed in batches by one
+//thread per core while the next batch is read.
+void PolyBook::build_from_pgn(int argc, char* argv[])
 {
-    int best_weight = polyhash[index_first].weight;
-    index_weight_count = best_weight;
-    uint64_t key = polyhash[index_first].key;
+    if (argc < 2)
+    {
+        sync_cout << "info string Error : Incorrect book_from_pgn command" << sync_endl;
+        sync_cout << "info string Syntax: book_from_pgn <compact pgn> <book> [plies]" << sync_endl;
+        return;
+    }
 
-    index_count = 1;
-    index_best = index_first;
+    const string inputPath = Utility::unquote(argv[0]);
+    const string bookfile = Utility::map_path(Utility::unquote(argv[1]));
+    const int maxPly = argc >= 3 ? atoi(argv[2]) : 40;
+    const bool chess960 = Options["UCI_Chess960"];
 
-    for (int i = index_first + 1; i<keycount; i++)
+    ifstream in(inputPath);
+    if (!in.is_open())
     {
-        if (polyhash[i].key != key)
-            break;
+        sync_cout << "info string Could not open " << inputPath << " for reading" << sync_endl;
+        return;
+    }
+
+    sync_cout << "\nBuilding book from compact PGN: " << inputPath
+              << "\nBook file: " << bookfile
+              << "\nPlies: " << maxPly << "\n" << sync_endl;
+
+    constexpr size_t GamesPerShard = 4096;
+
+    struct Shard {
+        vector<string> games;
+        vector<PolyHash> entries;
+        size_t errors = 0;
+    };
+
+    //Replays the games of a shard
+    auto convert_shard = [&](Shard& shard) {
+
+        for (const string& line : shard.games)
+        {
+            istringstream ss(line.substr(1, line.size() - 2));
+            string fen, result, token;
+
+            getline(ss, fen, ',');
+            getline(ss, result, ',');
+
+            const Color winner = result == "w" ? WHITE : result == "b" ? BLACK : COLOR_NB;
+            if (winner == COLOR_NB && result != "d")
+            {
+                ++shard.errors;
+                continue;
+            }
+
+            StateListPtr states(new deque<StateInfo>(1));
+            Position pos;
+            pos.set(fen, chess960, &states->back(), Threads.main());
+
+            for (int ply = 0; ply < maxPly && getline(ss, token, ','); ++ply)
+            {
+                token.erase(min(token.find(':'), token.size()));
 
-        index_count++;
-        index_weight_count += polyhash[i].weight;
-        if (polyhash[i].weight > best_weight)
+                Move m = UCI::to_move(pos, token);
+                if (m == MOVE_NONE)
+                {
+                    ++shard.errors;
+                    break;
+                }
+
+                const uint16_t weight = winner == COLOR_NB ? 1 : winner == pos.side_to_move() ? 2 : 0;
+                shard.entries.push_back({ polyglot_key(pos), sf_move_to_pg_move(m), weight, 0 });
+
+                states->emplace_back();
+                pos.do_move(m, states->back());
+            }
+        }
+    };
+
+    //Reads the games of the next batch, returns the number of games read
+    auto read_games = [&](vector<Shard>& shards) {
+
+        size_t numGames = 0;
+        string line;
+        for (Shard& shard : shards)
         {
-            best_weight = polyhash[i].weight;
-            index_best = i;
+            shard.games.clear();
+            while (shard.games.size() < GamesPerShard && getline(in, line))
+                if (line.size() >= 2 && line.front() == '{' && line.back() == '}')
+                    shard.games.push_back(std::move(line));
+
+            numGames += shard.games.size();
         }
-    }
 
-    int rand_pos = (rng.rand<uint32_t>() % index_weight_count);
-    int weight_count = 0;
-    index_rand = index_best;
+        return numGames;
+    };
+
+    const TimePoint start = now();
+    const size_t threadCount = Threads.size() + 1;
+    vector<Shard> shards[2] = { vector<Shard>(threadCount), vector<Shard>(threadCount) };
+    BookWriter writer(bookfile);
+    size_t games = 0, errors = 0, added = 0;
 
-    for (int i = index_first; i < index_first + index_count; i++)
+    size_t batch = 0;
+    size_t batchGames = read_games(shards[batch]);
+
+    while (batchGames)
     {
-        if ((rand_pos >= weight_count) && (rand_pos < weight_count + polyhash[i].weight))
+        //Task 0 reads the next batch, the others convert a shard each
+        size_t nextBatchGames = 0;
+        Threads.parallel_for(threadCount + 1, [&](size_t t) {
+            if (t)
+                convert_shard(shards[batch][t - 1]);
+            else
+                nextBatchGames = read_games(shards[batch ^ 1]);
+        });
+
+        for (Shard& shard : shards[batch])
         {
-            index_rand = i;
-            break;
+            for (const PolyHash& e : shard.entries)
+                writer.add(e);
+
+            added += shard.entries.size();
+            errors += shard.errors;
+            shard.entries.clear();
+            shard.errors = 0;
         }
-        weight_count += polyhash[i].weight;
+
+        games += batchGames;
+        sync_cout << "info string Games: " << games << " (errors: " << errors << "), moves: " << added << sync_endl;
+
+        batchGames = nextBatchGames;
+        batch ^= 1;
     }
 
-    return index_count;
+    if (writer.finish())
+        sync_cout << "info string Book saved: " << writer.positions << " positions, " << writer.moves
+                  << " moves in " << now() - start << " ms" << sync_endl;
 }
 
-bool PolyBook::check_draw(Position &pos, Move m)
+//merge_books() implements the book_merge command, which merges polyglot books:
+//
+//  book_merge <target> <book1> [book2] ... [bookN]
+//
+//The weights of a move found in several books are added. The target can be one
+//of the books to merge.
+void PolyBook::merge_books(int argc, char* argv[])
 {
-    StateInfo st;
+    if (argc < 2)
+    {
+        sync_cout << "info string Error : Incorrect book_merge command" << sync_endl;
+        sync_cout << "info string Syntax: book_merge <target> <book1> [book2] ... [bookN]" << sync_endl;
+        return;
+    }
 
-    pos.do_move(m, st, pos.gives_check(m));
-    bool draw = pos.is_draw(pos.game_ply());
-    pos.undo_move(m);
+    const string target = Utility::map_path(Utility::unquote(argv[0]));
+    const TimePoint start = now();
+    BookWriter writer(target);
 
-    return draw;
-}
+    sync_cout << "\nMerging books: ";
+    for (int i = 1; i < argc; ++i)
+        cout << "\n\t" << Utility::map_path(Utility::unquote(argv[i]));
+
+    cout << "\nTarget file: " << target << "\n" << sync_endl;
 
+    for (int i = 1; i < argc; ++i)
+    {
+        PolyBook book;
+        book.init(Utility::map_path(Utility::unquote(argv[i])));
+
+        for (int j = 0; j < book.keycount; ++j)
+            writer.add({ book.entry_key(j), book.entry_move(j), book.entry_weight(j), book.entry_learn(j) });
+    }
 
+    if (writer.finish())
+        sync_cout << "info string Book saved: " << writer.positions << " positions, " << writer.moves
+                  << " moves in " << now() - start << " ms" << sync_endl;
+}
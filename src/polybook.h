@@ -20,6 +20,7 @@
 #define POLYBOOK_H_INCLUDED
 
 #include "bitboard.h"
+#include "misc.h"
 #include "position.h"
 #include "string.h"
 
@@ -30,35 +31,49 @@ typedef struct {
     uint32_t learn;
 } PolyHash;
 
+//A book move of a position, as returned by PolyBook::probe_all()
+struct PolyBookEntry {
+    Stockfish::Move move;
+    uint16_t weight;
+    uint32_t learn;
+};
+
 class PolyBook
 {
 public:
 
     PolyBook();
-    ~PolyBook();
 
     void init(const std::string& bookfile);
     Stockfish::Move probe(Stockfish::Position& pos, bool bestBookMove);
+    std::vector<PolyBookEntry> probe_all(const Stockfish::Position& pos) const;
+
+    static void export_tree(int argc, char* argv[]);
+    static void build_from_exp(int argc, char* argv[]);
+    static void build_from_pgn(int argc, char* argv[]);
+    static void merge_books(int argc, char* argv[]);
+
+    static Stockfish::Key polyglot_key(const Stockfish::Position& pos);
+    static uint16_t sf_move_to_pg_move(Stockfish::Move m);
 
 private:
 
-    Stockfish::Key polyglot_key(const Stockfish::Position& pos);
-    Stockfish::Move pg_move_to_sf_move(const Stockfish::Position & pos, unsigned short pg_move);
+    Stockfish::Move pg_move_to_sf_move(const Stockfish::Position & pos, unsigned short pg_move) const;
 
-    int find_first_key(uint64_t key);
-    int get_key_data();
+    uint64_t entry_key(int idx) const;
+    uint16_t entry_move(int idx) const;
+    uint16_t entry_weight(int idx) const;
+    uint32_t entry_learn(int idx) const;
+
+    int lower_bound_key(uint64_t key) const;
 
     bool check_draw(Stockfish::Position& pos, Stockfish::Move m);
 
     int keycount;
-    PolyHash *polyhash;
+    const PolyHash *polyhash;
+    Stockfish::MemoryMappedFile bookFile;
+    std::vector<uint64_t> keyIndex;
     bool enabled;
-
-    int index_first;
-    int index_best;
-    int index_rand;
-    int index_count;
-    int index_weight_count;
 };
 
 extern PolyBook polybook[2];
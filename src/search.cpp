@@ -275,7 +275,7 @@ void MainThread::search() {
                               quality.emplace_back(temp, q.first);
                       }
 
-                      temp = temp->next;
+                      temp = temp->next();
                   }
 
                   //Sort experience moves based on quality
@@ -755,6 +755,8 @@ namespace {
     excludedMove = ss->excludedMove;
     posKey = excludedMove == MOVE_NONE ? pos.key() : pos.key() ^ make_key(excludedMove);
     tte = TT.probe(posKey, ss->ttHit);
+    thisThread->count(STAT_TT_PROBES);
+    thisThread->count(STAT_TT_HITS, ss->ttHit);
     ttValue = ss->ttHit ? value_from_tt(tte->value(), ss->ply, pos.rule50_count()) : VALUE_NONE;
     ttDepth = tte->depth();
     ttBound = tte->bound();
@@ -829,6 +831,11 @@ namespace {
 
     //Probe experience data
     const Experience::ExpEntryEx *expEx = excludedMove == MOVE_NONE && Experience::enabled() ? Experience::probe(pos.key()) : nullptr;
+    if (excludedMove == MOVE_NONE && Experience::enabled())
+    {
+        thisThread->count(STAT_EXP_PROBES);
+        thisThread->count(STAT_EXP_HITS, expEx != nullptr);
+    }
     const Experience::ExpEntryEx* tempExp = expEx;
     const Experience::ExpEntryEx* bestExp = nullptr;
 
@@ -883,7 +890,7 @@ namespace {
             }
         }
 
-        tempExp = tempExp->next;
+        tempExp = tempExp->next();
     }
 
     // At non-PV nodes we check for an early TT cutoff
@@ -1550,6 +1557,9 @@ namespace {
               else
               {
                   assert(value >= beta); // Fail high
+                  thisThread->count(STAT_CUTOFFS);
+                  thisThread->count(STAT_FIRST_MOVE_CUTOFFS, moveCount == 1);
+                  thisThread->count(STAT_CUTOFF_MOVE_SUM, moveCount);
                   break;
               }
           }
@@ -1658,6 +1668,7 @@ namespace {
     gameCycle = false;
 
     thisThread->nodes++;
+    thisThread->count(STAT_QSEARCH_NODES);
 
     if (pos.has_game_cycle(ss->ply))
     {
@@ -1688,6 +1699,8 @@ namespace {
     // Transposition table lookup
     posKey = pos.key();
     tte = TT.probe(posKey, ss->ttHit);
+    thisThread->count(STAT_TT_PROBES);
+    thisThread->count(STAT_TT_HITS, ss->ttHit);
     ttValue = ss->ttHit ? value_from_tt(tte->value(), ss->ply, pos.rule50_count()) : VALUE_NONE;
     ttBound = tte->bound();
     ttMove = ss->ttHit ? tte->move() : MOVE_NONE;
@@ -2051,6 +2064,9 @@ void MainThread::check_time() {
   {
       lastInfoTime = tick;
       dbg_print();
+#ifdef USE_STATS
+      Threads.print_stats(false);
+#endif
   }
 
   // We should not stop pondering until told so by the GUI
@@ -178,6 +178,16 @@ namespace Stockfish::Simd {
 
 #if defined (USE_AVX2)
 
+    // Without AVX-512, AVX-VNNI provides vpdpbusd on 256 bit registers with a VEX
+    // encoding, which the assembler must be asked for explicitly.
+# if defined (USE_AVXVNNI)
+#   define VPDPBUSD_256 "%{vex%} vpdpbusd"
+#   define mm256_dpbusd_epi32 _mm256_dpbusd_avx_epi32
+# else
+#   define VPDPBUSD_256 "vpdpbusd"
+#   define mm256_dpbusd_epi32 _mm256_dpbusd_epi32
+# endif
+
     [[maybe_unused]] static int m256_hadd(__m256i sum, int bias) {
       __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
       sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_PERM_BADC));
@@ -208,12 +218,12 @@ namespace Stockfish::Simd {
 # if defined (USE_VNNI)
 #   if defined (USE_INLINE_ASM)
       asm(
-        "vpdpbusd %[b], %[a], %[acc]\n\t"
+        VPDPBUSD_256 " %[b], %[a], %[acc]\n\t"
         : [acc]"+v"(acc)
         : [a]"v"(a), [b]"vm"(b)
       );
 #   else
-      acc = _mm256_dpbusd_epi32(acc, a, b);
+      acc = mm256_dpbusd_epi32(acc, a, b);
 #   endif
 # else
 #   if defined (USE_INLINE_ASM)
@@ -240,14 +250,14 @@ namespace Stockfish::Simd {
 # if defined (USE_VNNI)
 #   if defined (USE_INLINE_ASM)
       asm(
-        "vpdpbusd %[b0], %[a0], %[acc]\n\t"
-        "vpdpbusd %[b1], %[a1], %[acc]\n\t"
+        VPDPBUSD_256 " %[b0], %[a0], %[acc]\n\t"
+        VPDPBUSD_256 " %[b1], %[a1], %[acc]\n\t"
         : [acc]"+v"(acc)
         : [a0]"v"(a0), [b0]"vm"(b0), [a1]"v"(a1), [b1]"vm"(b1)
       );
 #   else
-      acc = _mm256_dpbusd_epi32(acc, a0, b0);
-      acc = _mm256_dpbusd_epi32(acc, a1, b1);
+      acc = mm256_dpbusd_epi32(acc, a0, b0);
+      acc = mm256_dpbusd_epi32(acc, a1, b1);
 #   endif
 # else
 #   if defined (USE_INLINE_ASM)
@@ -270,6 +280,9 @@ namespace Stockfish::Simd {
 # endif
     }
 
+# undef VPDPBUSD_256
+# undef mm256_dpbusd_epi32
+
 #endif
 
 #if defined (USE_SSSE3)
@@ -19,6 +19,8 @@
 #include <cassert>
 
 #include <algorithm> // For std::count
+#include <iomanip>
+#include <sstream>
 #include "movegen.h"
 #include "search.h"
 #include "thread.h"
@@ -30,6 +32,30 @@ namespace Stockfish {
 
 ThreadPool Threads; // Global object
 
+namespace {
+
+// Each woken helper wakes the next WakeFanout helpers, so that starting n
+// threads takes O(log n) sequential wakeups instead of n.
+constexpr size_t WakeFanout = 4;
+
+// spin_wait() busy waits, for at most 'us' microseconds, until the flag gets
+// the given value. It returns false if the flag did not change in time.
+
+bool spin_wait(const std::atomic<bool>& flag, bool value, int us) {
+
+  const int64_t deadline = now_us() + us;
+
+  while (flag.load(std::memory_order_acquire) != value)
+      if (now_us() >= deadline)
+          return false;
+      else
+          std::this_thread::yield();
+
+  return true;
+}
+
+} // namespace
+
 
 /// Thread constructor launches the thread and waits until it goes to sleep
 /// in idle_loop(). Note that 'searching' and 'exit' should be already set.
@@ -53,10 +79,17 @@ Thread::~Thread() {
 }
 
 
-/// Thread::clear() reset histories, usually before a new game
+/// Thread::clear() reset histories, usually before a new game. It is run by
+/// the thread itself (see ThreadPool::clear()), so that the tables are first
+/// touched, and thus physically allocated, on the thread's own NUMA node.
 
 void Thread::clear() {
 
+  const int64_t start = now_us();
+
+  pawnsTable.allocate();
+  materialTable.allocate();
+
   counterMoves.fill(MOVE_NONE);
   mainHistory.fill(0);
   lowPlyHistory.fill(0);
@@ -70,6 +103,8 @@ void Thread::clear() {
                       h->fill(0);
           continuationHistory[inCheck][c][NO_PIECE][0]->fill(Search::CounterMovePruneThreshold - 1);
       }
+
+  clearTime = now_us() - start;
 }
 
 
@@ -83,11 +118,31 @@ void Thread::start_searching() {
 }
 
 
+/// Thread::start_job() wakes up the thread to run the given job instead of a
+/// search. It returns false, without waiting, if the thread is busy.
+
+bool Thread::start_job(std::function<void()> f) {
+
+  std::lock_guard<std::mutex> lk(mutex);
+  if (searching)
+      return false;
+
+  job = std::move(f);
+  searching = true;
+  cv.notify_one(); // Wake up the thread in idle_loop()
+  return true;
+}
+
+
 /// Thread::wait_for_search_finished() blocks on the condition variable
-/// until the thread has finished searching.
+/// until the thread has finished searching. If "Thread Spin Time" is set it
+/// first spins on the flag, which avoids a futex wakeup at the end of short searches.
 
 void Thread::wait_for_search_finished() {
 
+  if (Threads.spinTime && spin_wait(searching, false, Threads.spinTime))
+      return;
+
   std::unique_lock<std::mutex> lk(mutex);
   cv.wait(lk, [&]{ return !searching; });
 }
@@ -111,14 +166,37 @@ void Thread::idle_loop() {
       std::unique_lock<std::mutex> lk(mutex);
       searching = false;
       cv.notify_one(); // Wake up anyone waiting for search finished
-      cv.wait(lk, [&]{ return searching; });
+
+      // Spin for a while before blocking, so that a search started soon after
+      // the previous one does not pay for a futex wakeup.
+      if (Threads.spinTime)
+      {
+          lk.unlock();
+          spin_wait(searching, true, Threads.spinTime);
+          lk.lock();
+      }
+
+      cv.wait(lk, [&]{ return searching.load(); });
 
       if (exit)
           return;
 
       lk.unlock();
 
-      search();
+      if (job)
+      {
+          job();
+          job = nullptr;
+      }
+      else
+      {
+          startDelay = now_us() - Threads.searchStart;
+
+          if (idx)
+              Threads.wake_helpers(idx);
+
+          search();
+      }
   }
 }
 
@@ -167,8 +245,18 @@ void ThreadPool::setFull(size_t requested) {
 
 void ThreadPool::clear() {
 
+  const int64_t start = now_us();
+
+  // Every thread clears its own tables, all in parallel. A thread that is
+  // unexpectedly busy is cleared by the caller as before.
   for (Thread* th : *this)
-      th->clear();
+      if (!th->start_job([th]{ th->clear(); }))
+          th->clear();
+
+  for (Thread* th : *this)
+      th->wait_for_search_finished();
+
+  clearTime = now_us() - start;
 
   main()->callsCnt = 0;
   main()->bestPreviousScore = VALUE_INFINITE;
@@ -217,8 +305,13 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
       th->rootMoves = rootMoves;
       th->rootPos.set(pos.fen(), pos.is_chess960(), &th->rootState, th);
       th->rootState = setupStates->back();
+      th->startDelay = -1;
+
+      for (auto& c : th->stats)
+          c = 0;
   }
 
+  searchStart = now_us();
   main()->start_searching();
 }
 
@@ -254,23 +347,219 @@ Thread* ThreadPool::get_best_thread() const {
 }
 
 
-/// Start non-main threads
+/// Start non-main threads. All of them are flagged as searching first, so that
+/// waiting for them is correct however late they are woken, then the wakeup is
+/// broadcast down a tree: the main thread wakes the first helpers, and each woken
+/// helper wakes its own children (see wake_helpers()). The flags are only set
+/// here: a helper that starts on its own while spinning, and finishes, must not
+/// be started again by the late wakeup of its parent.
 
 void ThreadPool::start_searching() {
 
     for (Thread* th : *this)
         if (th != front())
-            th->start_searching();
+        {
+            std::lock_guard<std::mutex> lk(th->mutex);
+            th->searching = true;
+        }
+
+    wake_helpers(0);
+}
+
+
+/// ThreadPool::wake_helpers() wakes the children of thread idx in the wakeup
+/// tree. It only notifies them, their searching flag is already set.
+
+void ThreadPool::wake_helpers(size_t idx) {
+
+    for (size_t i = idx * WakeFanout + 1; i <= idx * WakeFanout + WakeFanout && i < size(); ++i)
+    {
+        Thread* th = (*this)[i];
+        std::lock_guard<std::mutex> lk(th->mutex);
+        th->cv.notify_one();
+    }
 }
 
 
-/// Wait for non-main threads
+/// Wait for non-main threads, and record the start and stop latencies of the search
+
+void ThreadPool::wait_for_search_finished() {
 
-void ThreadPool::wait_for_search_finished() const {
+    const int64_t stopStart = now_us();
 
     for (Thread* th : *this)
         if (th != front())
             th->wait_for_search_finished();
+
+    stopLatency.add(now_us() - stopStart);
+
+    int64_t rampUp = 0;
+    for (Thread* th : *this)
+        rampUp = std::max(rampUp, th->startDelay);
+
+    startLatency.add(rampUp);
+}
+
+
+/// ThreadPool::print_latency() prints the search start and stop latencies
+/// collected so far, to help tuning "Move Overhead", and the per thread memory
+/// and time taken by the last clear().
+
+void ThreadPool::print_latency() const {
+
+    auto print = [](const char* name, const Latency& l) {
+        const uint64_t count = l.count, sum = l.sum, max = l.max;
+        sync_cout << "info string Search " << name << " latency: searches " << count
+                  << " avg " << (count ? sum / count : 0) << " us"
+                  << " max " << max << " us" << sync_endl;
+    };
+
+    print("start", startLatency);
+    print("stop", stopLatency);
+
+    // Per thread memory is the Thread object itself plus its pawn and material tables
+    int64_t maxClear = 0, sumClear = 0;
+    for (Thread* th : *this)
+        maxClear = std::max(maxClear, th->clearTime), sumClear += th->clearTime;
+
+    sync_cout << "info string Thread clear: threads " << size()
+              << " memory " << (sizeof(MainThread) + Pawns::Table::bytes() + Material::Table::bytes()) / 1024
+              << " kB per thread, per thread avg " << (size() ? sumClear / int64_t(size()) : 0)
+              << " us max " << maxClear << " us, total " << clearTime << " us" << sync_endl;
+}
+
+
+/// ThreadPool::parallel_for() calls f(i) for every i in [0, count) on the idle
+/// threads of the pool and on the calling thread, without creating threads.
+/// Each worker starts with an equal slice of the tasks. Once its slice is done
+/// it steals the back half of the largest slice left, so that tasks of uneven
+/// cost are balanced, and the slices of threads busy searching are taken over
+/// by the others. Slices are packed as [begin, end) in one atomic word.
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& f) {
+
+  assert(count < (size_t(1) << 32));
+
+  struct alignas(64) Slice {
+    std::atomic<uint64_t> range;
+  };
+
+  auto pack  = [](uint64_t begin, uint64_t end) { return begin | (end << 32); };
+  auto begin = [](uint64_t r) { return uint32_t(r); };
+  auto end   = [](uint64_t r) { return uint32_t(r >> 32); };
+
+  const size_t workers = size() + 1;
+  std::vector<Slice> slices(workers);
+
+  for (size_t w = 0; w < workers; ++w)
+      slices[w].range = pack(count * w / workers, count * (w + 1) / workers);
+
+  auto work = [&](size_t w) {
+
+      std::atomic<uint64_t>& own = slices[w].range;
+
+      while (true)
+      {
+          // Run the tasks of our slice from the front
+          uint64_t r = own.load(std::memory_order_relaxed);
+          while (begin(r) < end(r))
+              if (own.compare_exchange_weak(r, r + 1, std::memory_order_relaxed))
+              {
+                  f(begin(r));
+                  r = own.load(std::memory_order_relaxed);
+              }
+
+          // Find the largest slice left, stop when all are done
+          size_t victim = workers, most = 0;
+          for (size_t v = 0; v < workers; ++v)
+          {
+              const uint64_t vr = slices[v].range.load(std::memory_order_relaxed);
+              if (begin(vr) < end(vr) && end(vr) - begin(vr) > most)
+                  victim = v, most = end(vr) - begin(vr);
+          }
+
+          if (victim == workers)
+              return;
+
+          // Steal its back half, which becomes our slice
+          uint64_t vr = slices[victim].range.load(std::memory_order_relaxed);
+          if (begin(vr) < end(vr))
+          {
+              const uint64_t mid = end(vr) - (end(vr) - begin(vr) + 1) / 2;
+              if (slices[victim].range.compare_exchange_strong(vr, pack(begin(vr), mid), std::memory_order_relaxed))
+                  own.store(pack(mid, end(vr)), std::memory_order_relaxed);
+          }
+      }
+  };
+
+  std::vector<Thread*> started;
+  for (size_t i = 0; i < size(); ++i)
+      if ((*this)[i]->start_job([&work, i]() { work(i + 1); }))
+          started.push_back((*this)[i]);
+
+  work(0);
+
+  for (Thread* th : started)
+      th->wait_for_search_finished();
+}
+
+
+/// ThreadPool::stat() returns the sum of a statistics counter over all the
+/// threads. It is always zero in builds without USE_STATS.
+
+uint64_t ThreadPool::stat(StatsCounter c) const {
+
+  uint64_t sum = 0;
+
+  for (Thread* th : *this)
+      sum += th->stats[c].load(std::memory_order_relaxed);
+
+  return sum;
+}
+
+
+/// ThreadPool::print_stats() prints the statistics of the current or last search
+/// for the whole pool, preceded by those of every thread if requested.
+
+void ThreadPool::print_stats([[maybe_unused]] bool perThread) const {
+
+#ifdef USE_STATS
+    auto print = [](const std::string& name, uint64_t nodes, const uint64_t* c) {
+
+        auto pct = [](uint64_t a, uint64_t b) { return b ? 100.0 * a / b : 0.0; };
+        uint64_t nnue = c[STAT_NNUE_UPDATES] + c[STAT_NNUE_REFRESHES];
+        std::ostringstream ss;
+
+        ss << std::fixed << std::setprecision(1)
+           << "info string stats " << name
+           << " nodes "       << nodes
+           << " tthit "       << pct(c[STAT_TT_HITS], c[STAT_TT_PROBES]) << "%"
+           << " exphit "      << pct(c[STAT_EXP_HITS], c[STAT_EXP_PROBES]) << "%"
+           << " nnuerefresh " << pct(c[STAT_NNUE_REFRESHES], nnue) << "%"
+           << " qsearch "     << pct(c[STAT_QSEARCH_NODES], nodes) << "%"
+           << " cutoffs "     << c[STAT_CUTOFFS]
+           << " firstmove "   << pct(c[STAT_FIRST_MOVE_CUTOFFS], c[STAT_CUTOFFS]) << "%"
+           << " cutoffmove "  << (c[STAT_CUTOFFS] ? double(c[STAT_CUTOFF_MOVE_SUM]) / c[STAT_CUTOFFS] : 0.0)
+           << " pawnmiss "    << pct(c[STAT_PAWN_MISSES], c[STAT_PAWN_PROBES]) << "%";
+
+        sync_cout << ss.str() << sync_endl;
+    };
+
+    uint64_t total[STAT_NB] = {}, c[STAT_NB];
+
+    for (Thread* th : *this)
+    {
+        for (int i = 0; i < STAT_NB; ++i)
+            total[i] += c[i] = th->stats[i].load(std::memory_order_relaxed);
+
+        if (perThread)
+            print("thread " + std::to_string(th->id()), th->nodes.load(std::memory_order_relaxed), c);
+    }
+
+    print("total", nodes_searched(), total);
+#else
+    sync_cout << "info string Statistics are not compiled in, build with 'make build stats=yes'" << sync_endl;
+#endif
 }
 
 } // namespace Stockfish
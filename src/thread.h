@@ -21,6 +21,7 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -34,6 +35,19 @@
 
 namespace Stockfish {
 
+/// StatsCounter lists the per-thread search statistics. They are only counted
+/// in builds made with 'make build stats=yes' (USE_STATS), and cost nothing
+/// otherwise. See the "stats" command.
+
+enum StatsCounter {
+  STAT_TT_PROBES, STAT_TT_HITS, STAT_EXP_PROBES, STAT_EXP_HITS,
+  STAT_NNUE_UPDATES, STAT_NNUE_REFRESHES, STAT_QSEARCH_NODES,
+  STAT_CUTOFFS, STAT_FIRST_MOVE_CUTOFFS, STAT_CUTOFF_MOVE_SUM,
+  STAT_PAWN_PROBES, STAT_PAWN_SHARED_HITS, STAT_PAWN_MISSES,
+  STAT_NB
+};
+
+
 /// Thread class keeps together all the thread-related stuff. We use
 /// per-thread pawn and material hash tables so that once we get a
 /// pointer to an entry its life time is unlimited and we don't have
@@ -41,10 +55,14 @@ namespace Stockfish {
 
 class Thread {
 
+  friend struct ThreadPool;
+
   std::mutex mutex;
   std::condition_variable cv;
   size_t idx;
-  bool exit = false, searching = true; // Set before starting std::thread
+  bool exit = false;
+  std::atomic<bool> searching = true; // Set before starting std::thread
+  std::function<void()> job;
   NativeThread stdThread;
 
 public:
@@ -54,9 +72,18 @@ public:
   void clear();
   void idle_loop();
   void start_searching();
+  bool start_job(std::function<void()>);
   void wait_for_search_finished();
   size_t id() const { return idx; }
 
+  // Only the owning thread writes its counters, so a relaxed load and store is
+  // enough and avoids the cost of an atomic increment.
+  void count([[maybe_unused]] StatsCounter c, [[maybe_unused]] uint64_t v = 1) {
+#ifdef USE_STATS
+    stats[c].store(stats[c].load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+#endif
+  }
+
   Pawns::Table pawnsTable;
   Material::Table materialTable;
   size_t pvIdx, pvLast;
@@ -76,6 +103,10 @@ public:
   ContinuationHistory continuationHistory[2][2];
   bool fullSearch;
   Score trend;
+  int64_t startDelay; // Microseconds from 'go' to this thread starting its search
+  int64_t clearTime;  // Microseconds spent in the last clear()
+  Eval::NNUE::AccumulatorCache accumulatorCache;
+  std::atomic<uint64_t> stats[STAT_NB] = {};
 };
 
 
@@ -111,11 +142,33 @@ struct ThreadPool : public std::vector<Thread*> {
   MainThread* main()        const { return static_cast<MainThread*>(front()); }
   uint64_t nodes_searched() const { return accumulate(&Thread::nodes); }
   uint64_t tb_hits()        const { return accumulate(&Thread::tbHits); }
+  uint64_t stat(StatsCounter c) const;
   Thread* get_best_thread() const;
   void start_searching();
-  void wait_for_search_finished() const;
+  void wake_helpers(size_t);
+  void wait_for_search_finished();
+  void parallel_for(size_t, const std::function<void(size_t)>&);
+  void print_latency() const;
+  void print_stats(bool perThread) const;
 
   std::atomic_bool stop, increaseDepth;
+  int spinTime = 0;    // Microseconds to spin before sleeping, see "Thread Spin Time"
+  int64_t searchStart; // now_us() when the last search was started
+
+  // Search start (go until the last thread is searching) and stop (stop until
+  // the last thread is parked) latencies, in microseconds. Written by the main
+  // thread only, and read by the "latency" command.
+  struct Latency {
+    std::atomic<uint64_t> count = 0, sum = 0, max = 0;
+    void add(int64_t us) {
+      count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      sum.store(sum.load(std::memory_order_relaxed) + uint64_t(us), std::memory_order_relaxed);
+      if (uint64_t(us) > max.load(std::memory_order_relaxed))
+          max.store(uint64_t(us), std::memory_order_relaxed);
+    }
+  } startLatency, stopLatency;
+
+  int64_t clearTime; // Wall time of the last clear(), in microseconds
 
 private:
   StateListPtr setupStates;
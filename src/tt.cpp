@@ -16,6 +16,10 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstddef>   // For offsetof
 #include <cstring>   // For std::memset
 #include <iostream>
 #include <thread>
@@ -32,6 +36,7 @@ using std::string;
 #include "thread.h"
 
 #include "bitboard.h"
+#include "evaluate.h"
 #include "misc.h"
 #include "thread.h"
 #include "tt.h"
@@ -39,48 +44,37 @@ using std::string;
 
 namespace Stockfish {
 
-//https://stackoverflow.com/questions/236129/most-elegant-way-to-split-a-string
-template<typename Out>
-void split(const std::string &s, char delim, Out result) {
-	std::stringstream ss;
-	ss.str(s);
-	std::string item;
-	while (std::getline(ss, item, delim)) {
-		*(result++) = item;
-	}
-}
-
-std::vector<std::string> split(const std::string &s, char delim) {
-	std::vector<std::string> elems;
-	split(s, delim, std::back_inserter(elems));
-	return elems;
-}
-
 TranspositionTable TT; // Our global transposition table
 
 /// TTEntry::save() populates the TTEntry with a new node's data, possibly
 /// overwriting an old position. Update is not atomic and can be racy.
 
-void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev) {
+template<typename KeyType>
+void TTEntryT<KeyType>::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev) {
 
   // Preserve any existing move for the same position
-  if (m || k != key)
+  if (m || KeyType(k) != key)
       move16 = (uint16_t)m;
 
   // Overwrite less valuable entries
   if (   b == BOUND_EXACT
-      || k != key
+      || KeyType(k) != key
       || d - DEPTH_OFFSET > depth8 - 4)
   {
       assert(d > DEPTH_OFFSET);
       assert(d < 256 + DEPTH_OFFSET);
 
-      key       =  k;
+      key       =  KeyType(k);
       depth8    = (uint8_t)(d - DEPTH_OFFSET);
       genBound8 = (uint8_t)(TT.generation8 | uint8_t(pv) << 2 | b);
       value16   = (int16_t)v;
       eval16    = (int16_t)ev;
   }
+
+  // Flag the block after writing, so that a checkpoint copying it concurrently
+  // leaves it flagged for the next one.
+  if (TT.dirty)
+      TT.mark_dirty(this);
 }
 
 
@@ -88,45 +82,92 @@ void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev)
 /// measured in megabytes. Transposition table consists of a power of 2 number
 /// of clusters and each cluster consists of ClusterSize number of TTEntry.
 
-void TranspositionTable::resize(size_t mbSize) {
+template<typename Layout>
+void TranspositionTableT<Layout>::resize(size_t mbSize) {
+
+  auto lock = pause_checkpoint();
+
+  allocate(mbSize * 1024 * 1024 / sizeof(Cluster));
+
+  clear();
+}
+
+
+/// TranspositionTable::allocate() replaces the table by an uninitialized one
+/// of the given number of clusters. A mapped hash file is released first and
+/// is left as it is on disk.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::allocate(size_t newClusterCount) {
 
   Threads.main()->wait_for_search_finished();
 
-  aligned_large_pages_free(table);
+  auto lock = pause_checkpoint();
 
-  clusterCount = mbSize * 1024 * 1024 / sizeof(Cluster);
+  if (hashFile.is_mapped())
+      sync_cout << "info string Hash file " << hashFile.file_name()
+                << " unmapped, the table is now held in memory" << sync_endl;
+
+  free_table();
+
+  clusterCount = newClusterCount;
 
   table = static_cast<Cluster*>(aligned_large_pages_alloc(clusterCount * sizeof(Cluster)));
   if (!table)
   {
-      std::cerr << "Failed to allocate " << mbSize
+      std::cerr << "Failed to allocate " << clusterCount * sizeof(Cluster) / 1024 / 1024
                 << "MB for transposition table." << std::endl;
       exit(EXIT_FAILURE);
   }
 
-  clear();
+  // Interleaving must be requested before the pages are first touched by clear()
+  if (Options["HashNumaInterleave"])
+  {
+      if (WinProcGroup::interleave(table, clusterCount * sizeof(Cluster)))
+          sync_cout << "info string Hash interleaved over " << WinProcGroup::node_count() << " NUMA nodes" << sync_endl;
+      else
+          sync_cout << "info string Hash NUMA interleaving not available" << sync_endl;
+  }
+
+  reset_dirty(1);
 }
 
 
 /// TranspositionTable::clear() initializes the entire transposition table to zero,
-//  in a multi-threaded way.
+//  in a multi-threaded way. A table mapped from a hash file is first replaced by
+//  one in memory. On a NUMA machine there is at least one thread per
+//  node and the slices are assigned to the nodes in order, so that with the
+//  default first-touch policy the table is spread evenly over the nodes.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::clear() {
+
+  auto lock = pause_checkpoint();
 
-void TranspositionTable::clear() {
+  // Never write zeros through the mapping, that would erase the hash file
+  if (hashFile.is_mapped())
+      allocate(clusterCount);
+
+  reset_dirty(1);
 
   std::vector<std::thread> threads;
+  const size_t nodes = WinProcGroup::node_count();
+  const size_t threadCount = std::max(size_t(Options["Threads"]), nodes);
 
-  for (size_t idx = 0; idx < Options["Threads"]; ++idx)
+  for (size_t idx = 0; idx < threadCount; ++idx)
   {
-      threads.emplace_back([this, idx]() {
+      threads.emplace_back([this, idx, nodes, threadCount]() {
 
           // Thread binding gives faster search on systems with a first-touch policy
-          if (Options["Threads"] > 8)
+          if (nodes > 1)
+              WinProcGroup::bindThisThreadToNode(idx * nodes / threadCount);
+          else if (Options["Threads"] > 8)
               WinProcGroup::bindThisThread(idx);
 
           // Each thread will zero its part of the hash table
-          const size_t stride = size_t(clusterCount / Options["Threads"]),
-                       start  = size_t(stride * idx),
-                       len    = idx != Options["Threads"] - 1 ?
+          const size_t stride = clusterCount / threadCount,
+                       start  = stride * idx,
+                       len    = idx != threadCount - 1 ?
                                 stride : clusterCount - start;
 
           std::memset(&table[start], 0, len * sizeof(Cluster));
@@ -137,36 +178,789 @@ void TranspositionTable::clear() {
       th.join();
 }
 
-void TranspositionTable::set_hash_file_name(const std::string& fname) { hashfilename = fname; }
+template<typename Layout>
+void TranspositionTableT<Layout>::set_hash_file_name(const std::string& fname) {
 
-bool TranspositionTable::save() {
-	std::ofstream b_stream(hashfilename,
-		std::fstream::out | std::fstream::binary);
-	if (b_stream)
-	{
-		//b_stream.write(reinterpret_cast<char const *>(table), clusterCount * sizeof(Cluster));
-		for (unsigned long long i = 0; i < clusterCount * sizeof(Cluster); i += (1 << 30)) { //1GB
-#ifndef __min
-        #define __min(a,b) (((a) < (b)) ? (a) : (b))
-#endif
-		    unsigned long long j = __min((1 << 30), (clusterCount * sizeof(Cluster)) - i);
-			b_stream.write(reinterpret_cast<char const *>(table) + i, j);
-		}
-		return (b_stream.good());
-	}
-	return false;
+  auto lock = pause_checkpoint();
+
+  // The checkpoints now go to another file, which has to be written in full
+  if (fname != hashfilename)
+      reset_dirty(1);
+
+  hashfilename = fname;
 }
 
-void TranspositionTable::load() {
-	//file size: https://stackoverflow.com/questions/2409504/using-c-filestreams-fstream-how-can-you-determine-the-size-of-a-file
-	std::ifstream file;
-	file.open(hashfilename, std::ios::in | std::ios::binary);
-	file.ignore(std::numeric_limits<std::streamsize>::max());
-	std::streamsize size = file.gcount();
-	file.clear();   //  Since ignore will have set eof.
-	resize(size_t(size / 1024 / 1024));
-	file.seekg(0, std::ios::beg);
-	file.read(reinterpret_cast<char *>(table), clusterCount * sizeof(Cluster));
+
+namespace {
+
+  // A hash file starts with a HashFileHeader, padded to HashFileDataOffset bytes
+  // so that the clusters stay page aligned when the file is mapped. The clusters
+  // are followed by the CRC-32 of each block of HashFileBlockSize bytes of them.
+  constexpr char     HashFileMagic[8]   = { 'S', 'u', 'g', 'a', 'R', 'T', 'T', '\0' };
+  constexpr uint32_t HashFileVersion    = 2;
+  constexpr size_t   HashFileDataOffset = 64 * 1024;
+  constexpr size_t   HashFileBlockSize  = TranspositionTable::BlockSize;
+
+  enum HashFileFlags : uint32_t {
+    HF_COMPLETE   = 1, // Fully written, the checksums match the clusters
+    HF_MAPPED     = 2, // Used as a mapped table, clusters may have changed since the last save
+    HF_CHECKPOINT = 4  // A checkpoint was in progress, the interrupted blocks fail their checksum
+  };
+
+  struct HashFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t clusterSize;
+    uint64_t clusterCount;
+    uint64_t blockSize;
+    uint64_t blockCount;
+    uint32_t netHash;     // Identifies the evaluation the entries were computed with
+    uint32_t flags;
+    uint8_t  generation;
+    uint8_t  entrySize;   // Together with clusterSize identifies the cluster layout
+    uint8_t  padding[2];
+    uint32_t headerCrc;   // CRC-32 of all the fields above
+  };
+
+  uint32_t header_crc(const HashFileHeader& h) {
+    return crc32(&h, offsetof(HashFileHeader, headerCrc));
+  }
+
+  uint32_t net_hash() {
+    return Eval::useNNUE ? crc32(Eval::eval_file_loaded.data(), Eval::eval_file_loaded.size()) : 0;
+  }
+
+  size_t file_size(size_t dataSize, size_t blockCount) {
+    return HashFileDataOffset + dataSize + blockCount * sizeof(uint32_t);
+  }
+
+  // check_header() verifies that the header describes a hash file of the given
+  // size whose clusters can be used by this build. Files written with another
+  // block size are accepted, the checksums are then verified per h.blockSize.
+  bool check_header(const HashFileHeader& h, size_t fileSize, size_t clusterSize, size_t entrySize,
+                    const string& fname, bool quiet = false) {
+
+    string err;
+
+    if (std::memcmp(h.magic, HashFileMagic, sizeof(HashFileMagic)) || h.headerCrc != header_crc(h))
+        err = "is not a valid hash file";
+
+    else if (h.version != HashFileVersion)
+        err = "has unsupported version " + std::to_string(h.version);
+
+    else if (h.clusterSize != clusterSize || h.entrySize != entrySize)
+        err =  "has " + std::to_string(h.entrySize) + " bytes entries in " + std::to_string(h.clusterSize)
+             + " bytes clusters, expected " + std::to_string(entrySize) + " in " + std::to_string(clusterSize);
+
+    else if (!(h.flags & HF_COMPLETE))
+        err = "was not completely written";
+
+    else if (   !h.blockSize
+             || h.blockCount != (h.clusterCount * clusterSize + h.blockSize - 1) / h.blockSize
+             || fileSize != file_size(h.clusterCount * clusterSize, h.blockCount))
+        err = "is truncated or has an inconsistent size";
+
+    if (!err.empty())
+    {
+        if (!quiet)
+            sync_cout << "info string Hash file " << fname << " " << err << sync_endl;
+        return false;
+    }
+
+    if (h.netHash != net_hash() && !quiet)
+        sync_cout << "info string Hash file " << fname
+                  << " was saved with a different evaluation, its entries may be less reliable" << sync_endl;
+
+    return true;
+  }
+
+  // for_each_block_range() splits the blocks into a few contiguous ranges per
+  // search thread and processes the ranges in parallel on the thread pool.
+  template<typename F>
+  void for_each_block_range(size_t blockCount, const F& f) {
+
+    const size_t n = std::min(blockCount, 4 * (Threads.size() + 1));
+
+    Threads.parallel_for(n, [&](size_t i) {
+        f(blockCount * i / n, blockCount * (i + 1) / n);
+    });
+  }
+
+} // namespace
+
+
+/// TranspositionTable::free_table() releases the memory of the table, which is
+/// either our own large pages allocation or a view of the mapped hash file.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::free_table() {
+
+  if (hashFile.is_mapped())
+      hashFile.unmap();
+  else
+      aligned_large_pages_free(table);
+
+  table = nullptr;
+}
+
+
+/// TranspositionTable::map() uses the hash file directly as the table memory.
+/// Nothing is read upfront: the clusters are faulted in on demand during the
+/// search, and the OS writes modified pages back to the file. For this reason
+/// the block checksums are not verified here.
+
+template<typename Layout>
+bool TranspositionTableT<Layout>::map(const std::string& fname) {
+
+  Threads.main()->wait_for_search_finished();
+
+  auto lock = pause_checkpoint();
+
+  free_table();
+
+  HashFileHeader* h = nullptr;
+
+  if (hashFile.map(fname, true) && hashFile.size() >= HashFileDataOffset)
+  {
+      h = reinterpret_cast<HashFileHeader*>(hashFile.data());
+      if (!check_header(*h, hashFile.size(), sizeof(Cluster), sizeof(Entry), fname))
+          h = nullptr;
+  }
+
+  if (!h)
+  {
+      hashFile.unmap();
+      sync_cout << "info string Could not map hash file " << fname << sync_endl;
+
+      resize(size_t(Options["Hash"]));
+      return false;
+  }
+
+  // From now on the clusters in the file may differ from the saved checksums
+  h->flags |= HF_MAPPED;
+  h->headerCrc = header_crc(*h);
+  hashFile.flush(0, sizeof(HashFileHeader));
+
+  clusterCount = h->clusterCount;
+  table = reinterpret_cast<Cluster*>(hashFile.data() + HashFileDataOffset);
+  generation8 = h->generation;
+  reset_dirty(0);
+
+  sync_cout << "info string Hash file mapped: " << fname << " ("
+            << format_bytes(clusterCount * sizeof(Cluster), 2) << ")" << sync_endl;
+
+  return true;
+}
+
+
+/// TranspositionTable::save() writes the table to the given file, the hash file
+/// by default. Each search thread writes and checksums its own range of blocks
+/// through its own stream, so that a large table is written at the full speed
+/// of the disk. The header is written last, a partially written file is never
+/// accepted by load().
+
+template<typename Layout>
+bool TranspositionTableT<Layout>::save(const std::string& fname) {
+
+  Threads.main()->wait_for_search_finished();
+
+  auto lock = pause_checkpoint();
+
+  const size_t dataSize = clusterCount * sizeof(Cluster);
+  const size_t blockCount = (dataSize + HashFileBlockSize - 1) / HashFileBlockSize;
+
+  // A mapped table already lives in the hash file: refresh the checksums, then
+  // only the pages modified since the last flush have to be written back.
+  if (hashFile.is_mapped() && hashFile.file_name() == fname)
+  {
+      HashFileHeader* h = reinterpret_cast<HashFileHeader*>(hashFile.data());
+      uint32_t* crcs = reinterpret_cast<uint32_t*>(hashFile.data() + HashFileDataOffset + dataSize);
+      const size_t bs = h->blockSize;
+
+      for_each_block_range(h->blockCount, [&](size_t first, size_t last) {
+          for (size_t b = first; b < last; ++b)
+              crcs[b] = crc32(reinterpret_cast<const char*>(table) + b * bs,
+                              std::min(bs, dataSize - b * bs));
+      });
+
+      h->generation = generation8;
+      h->netHash = net_hash();
+      h->headerCrc = header_crc(*h);
+
+      return hashFile.flush(0, hashFile.size());
+  }
+
+  HashFileHeader h = {};
+  std::memcpy(h.magic, HashFileMagic, sizeof(HashFileMagic));
+  h.version      = HashFileVersion;
+  h.clusterSize  = sizeof(Cluster);
+  h.entrySize    = sizeof(Entry);
+  h.clusterCount = clusterCount;
+  h.blockSize    = HashFileBlockSize;
+  h.blockCount   = blockCount;
+  h.netHash      = net_hash();
+  h.generation   = generation8;
+
+  // Create the file with its final size and an empty header
+  {
+      std::ofstream out(fname, std::ios::out | std::ios::binary | std::ios::trunc);
+      out.seekp(file_size(dataSize, blockCount) - 1);
+      out.put('\0');
+
+      if (!out)
+      {
+          sync_cout << "info string Could not create hash file " << fname << sync_endl;
+          return false;
+      }
+  }
+
+  std::vector<uint32_t> crcs(blockCount);
+  std::atomic<bool> failed(false);
+
+  for_each_block_range(blockCount, [&](size_t first, size_t last) {
+
+      std::fstream f(fname, std::ios::in | std::ios::out | std::ios::binary);
+      f.seekp(HashFileDataOffset + first * HashFileBlockSize);
+
+      for (size_t b = first; b < last && f; ++b)
+      {
+          const char* data = reinterpret_cast<const char*>(table) + b * HashFileBlockSize;
+          const size_t len = std::min(HashFileBlockSize, dataSize - b * HashFileBlockSize);
+
+          crcs[b] = crc32(data, len);
+          f.write(data, len);
+      }
+
+      if (!f)
+          failed = true;
+  });
+
+  std::fstream f(fname, std::ios::in | std::ios::out | std::ios::binary);
+  f.seekp(HashFileDataOffset + dataSize);
+  f.write(reinterpret_cast<const char*>(crcs.data()), blockCount * sizeof(uint32_t));
+
+  h.flags = HF_COMPLETE;
+  h.headerCrc = header_crc(h);
+  f.seekp(0);
+  f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  f.close();
+
+  if (failed || !f)
+  {
+      sync_cout << "info string Failed to write hash file " << fname << sync_endl;
+      return false;
+  }
+
+  // Only a save to the hash file itself makes the checkpoints up to date
+  if (fname != hashfilename)
+      return true;
+
+  reset_dirty(0);
+
+  // In mapped mode continue on the file just written, so that the next
+  // saves are incremental.
+  if (Options["HashFileMapped"])
+      map(hashfilename);
+
+  return true;
+}
+
+
+/// TranspositionTable::load() replaces the table by the one saved in the hash
+/// file, including its generation. The header and the checksum of every block
+/// are verified, reading is done by all the search threads in parallel. A
+/// corrupted file leaves an empty table, except when a checkpoint was being
+/// written: then only the blocks it did not finish are cleared.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::load() {
+
+  auto lock = pause_checkpoint();
+
+  if (Options["HashFileMapped"])
+  {
+      map(hashfilename);
+      return;
+  }
+
+  std::ifstream in(hashfilename, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!in)
+  {
+      sync_cout << "info string Could not open hash file " << hashfilename << sync_endl;
+      return;
+  }
+
+  const size_t fileSize = size_t(in.tellg());
+
+  HashFileHeader h;
+  in.seekg(0);
+  if (   !in.read(reinterpret_cast<char*>(&h), sizeof(h))
+      || !check_header(h, fileSize, sizeof(Cluster), sizeof(Entry), hashfilename))
+      return;
+
+  const size_t dataSize = h.clusterCount * sizeof(Cluster);
+  const size_t bs = h.blockSize;
+  std::vector<uint32_t> crcs(h.blockCount);
+
+  in.seekg(HashFileDataOffset + dataSize);
+  in.read(reinterpret_cast<char*>(crcs.data()), h.blockCount * sizeof(uint32_t));
+  in.close();
+
+  allocate(h.clusterCount);
+  generation8 = h.generation;
+
+  // Unless the file has our block size the next checkpoint rewrites it in full
+  reset_dirty(bs != HashFileBlockSize);
+
+  std::atomic<size_t> badBlocks(0);
+
+  for_each_block_range(h.blockCount, [&](size_t first, size_t last) {
+
+      std::ifstream f(hashfilename, std::ios::in | std::ios::binary);
+      f.seekg(HashFileDataOffset + first * bs);
+
+      for (size_t b = first; b < last; ++b)
+      {
+          char* data = reinterpret_cast<char*>(table) + b * bs;
+          const size_t len = std::min(bs, dataSize - b * bs);
+
+          if (!f.read(data, len) || crc32(data, len) != crcs[b])
+          {
+              ++badBlocks;
+
+              if (h.flags & HF_CHECKPOINT)
+              {
+                  std::memset(data, 0, len);
+                  if (bs == HashFileBlockSize)
+                      dirtyBlocks[b] = 1;
+              }
+          }
+      }
+  });
+
+  if (badBlocks && (h.flags & HF_CHECKPOINT))
+      sync_cout << "info string Hash file " << hashfilename << " has an interrupted checkpoint, "
+                << badBlocks << " of " << h.blockCount << " blocks have been cleared" << sync_endl;
+
+  else if (badBlocks && !(h.flags & HF_MAPPED))
+  {
+      sync_cout << "info string Hash file " << hashfilename << " is corrupted (" << badBlocks
+                << " bad blocks of " << h.blockCount << "), the hash table has been cleared" << sync_endl;
+
+      clear();
+      return;
+  }
+
+  if (badBlocks)
+      sync_cout << "info string Hash file " << hashfilename << " was used as a mapped table, "
+                << badBlocks << " of " << h.blockCount << " blocks changed since its last save" << sync_endl;
+
+  sync_cout << "info string Hash file loaded: " << hashfilename << " ("
+            << format_bytes(dataSize, 2) << ")" << sync_endl;
+}
+
+
+/// TranspositionTable::reset_dirty() sizes the dirty map for the current table
+/// and sets all its flags to v, 1 meaning that the block has to be written by
+/// the next checkpoint.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::reset_dirty(uint8_t v) {
+
+  const size_t n = (clusterCount * sizeof(Cluster) + BlockSize - 1) / BlockSize;
+
+  if (n != dirtyBlockCount)
+  {
+      dirtyBlocks.reset(new std::atomic<uint8_t>[n]);
+      dirtyBlockCount = n;
+  }
+
+  for (size_t b = 0; b < n; ++b)
+      dirtyBlocks[b].store(v, std::memory_order_relaxed);
+
+  dirty = checkpointMinutes ? dirtyBlocks.get() : nullptr;
+}
+
+
+/// TranspositionTable::pause_checkpoint() interrupts a running checkpoint and
+/// returns a lock that keeps the next one from starting. It is taken by every
+/// function that replaces, clears or writes the table to the hash file.
+
+template<typename Layout>
+std::unique_lock<std::recursive_mutex> TranspositionTableT<Layout>::pause_checkpoint() {
+
+  checkpointAbort = true;
+  std::unique_lock<std::recursive_mutex> lock(tableMutex);
+  checkpointAbort = false;
+
+  return lock;
+}
+
+
+/// TranspositionTable::set_checkpoint() (re)starts the background thread that
+/// every given number of minutes writes the blocks modified since the previous
+/// checkpoint to the hash file, at most mbPerSecond MB per second (0 for no
+/// limit). Zero minutes stops checkpointing.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::set_checkpoint(int minutes, int mbPerSecond) {
+
+  if (checkpointThread.joinable())
+  {
+      {
+          std::lock_guard<std::mutex> lk(checkpointMutex);
+          checkpointExit = true;
+      }
+
+      checkpointCv.notify_one();
+      checkpointThread.join();
+  }
+
+  checkpointExit = false;
+  checkpointMinutes = minutes;
+  checkpointBandwidth = mbPerSecond;
+  dirty = nullptr;
+
+  if (!minutes)
+      return;
+
+  // Nothing has been tracked so far, the first checkpoint writes everything
+  {
+      auto lock = pause_checkpoint();
+      reset_dirty(1);
+  }
+
+  checkpointThread = std::thread(&TranspositionTableT::checkpoint_loop, this);
+}
+
+
+template<typename Layout>
+void TranspositionTableT<Layout>::checkpoint_loop() {
+
+  std::unique_lock<std::mutex> lk(checkpointMutex);
+
+  while (!checkpointCv.wait_for(lk, std::chrono::minutes(checkpointMinutes), [&]{ return bool(checkpointExit); }))
+  {
+      lk.unlock();
+      checkpoint();
+      lk.lock();
+  }
+}
+
+
+/// TranspositionTable::checkpoint() writes the dirty blocks to the hash file
+/// while the search goes on. Each block is copied before it is checksummed and
+/// written, and its checksum is written right after it, so that a crash during
+/// a checkpoint only loses the block being written. A hash file that does not
+/// match the current table is first rewritten in full. A mapped table only has
+/// its dirty blocks flushed.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::checkpoint() {
+
+  std::unique_lock<std::recursive_mutex> lock(tableMutex);
+
+  if (!table || checkpointAbort)
+      return;
+
+  const TimePoint start = now();
+  const size_t dataSize = clusterCount * sizeof(Cluster);
+  const size_t blockCount = dirtyBlockCount;
+  size_t written = 0, blocks = 0;
+  bool ok = true, interrupted = false;
+
+  // Sleep as long as needed to stay within the bandwidth cap, in short steps
+  // to leave quickly when the table is needed.
+  auto throttle = [&]() {
+
+      if (!checkpointBandwidth)
+          return;
+
+      const TimePoint due = start + TimePoint(written * 1000 / (size_t(checkpointBandwidth) * 1024 * 1024));
+
+      while (now() < due && !checkpointAbort && !checkpointExit)
+          std::this_thread::sleep_for(std::chrono::milliseconds(std::clamp(due - now(), TimePoint(1), TimePoint(50))));
+  };
+
+  auto next_dirty = [&](size_t b) {
+      interrupted |= checkpointAbort || checkpointExit;
+      return !interrupted && dirtyBlocks[b].exchange(0, std::memory_order_relaxed);
+  };
+
+  const string fname = hashFile.is_mapped() ? hashFile.file_name() : hashfilename;
+
+  if (hashFile.is_mapped())
+  {
+      for (size_t b = 0; b < blockCount; ++b)
+          if (next_dirty(b))
+          {
+              const size_t len = std::min(BlockSize, dataSize - b * BlockSize);
+
+              ok &= hashFile.flush(HashFileDataOffset + b * BlockSize, len);
+              written += len, ++blocks;
+              throttle();
+          }
+  }
+  else
+  {
+      HashFileHeader h = {};
+      std::vector<uint32_t> crcs(blockCount);
+      std::fstream f(fname, std::ios::in | std::ios::out | std::ios::binary | std::ios::ate);
+
+      const size_t fileSize = f ? size_t(f.tellg()) : 0;
+      f.seekg(0);
+
+      const bool reuse =   f.read(reinterpret_cast<char*>(&h), sizeof(h))
+                        && check_header(h, fileSize, sizeof(Cluster), sizeof(Entry), fname, true)
+                        && h.clusterCount == clusterCount
+                        && h.blockSize == HashFileBlockSize
+                        && !(h.flags & HF_MAPPED);
+
+      if (reuse)
+          f.seekg(HashFileDataOffset + dataSize)
+           .read(reinterpret_cast<char*>(crcs.data()), blockCount * sizeof(uint32_t));
+      else
+      {
+          f.close();
+
+          {
+              std::ofstream out(fname, std::ios::out | std::ios::binary | std::ios::trunc);
+              out.seekp(file_size(dataSize, blockCount) - 1);
+              out.put('\0');
+          }
+
+          f.open(fname, std::ios::in | std::ios::out | std::ios::binary);
+
+          h = {};
+          std::memcpy(h.magic, HashFileMagic, sizeof(HashFileMagic));
+          h.version      = HashFileVersion;
+          h.clusterSize  = sizeof(Cluster);
+          h.entrySize    = sizeof(Entry);
+          h.clusterCount = clusterCount;
+          h.blockSize    = HashFileBlockSize;
+          h.blockCount   = blockCount;
+
+          for (size_t b = 0; b < blockCount; ++b)
+              dirtyBlocks[b] = 1;
+      }
+
+      h.flags |= HF_CHECKPOINT;
+      h.headerCrc = header_crc(h);
+      f.seekp(0).write(reinterpret_cast<const char*>(&h), sizeof(h)).flush();
+
+      std::vector<char> buffer(BlockSize);
+
+      for (size_t b = 0; b < blockCount && f; ++b)
+          if (next_dirty(b))
+          {
+              const size_t len = std::min(BlockSize, dataSize - b * BlockSize);
+
+              std::memcpy(buffer.data(), reinterpret_cast<const char*>(table) + b * BlockSize, len);
+              crcs[b] = crc32(buffer.data(), len);
+
+              f.seekp(HashFileDataOffset + b * BlockSize).write(buffer.data(), len);
+              f.seekp(HashFileDataOffset + dataSize + b * sizeof(uint32_t))
+               .write(reinterpret_cast<const char*>(&crcs[b]), sizeof(uint32_t));
+
+              written += len, ++blocks;
+              throttle();
+          }
+
+      // A new file is usable only once all its blocks have been written
+      f.flush();
+      h.flags      = reuse || !interrupted ? uint32_t(HF_COMPLETE) : 0;
+      h.generation = generation8;
+      h.netHash    = net_hash();
+      h.headerCrc  = header_crc(h);
+      f.seekp(0).write(reinterpret_cast<const char*>(&h), sizeof(h));
+      f.close();
+
+      ok = bool(f);
+  }
+
+  if (!ok)
+  {
+      reset_dirty(1);
+      sync_cout << "info string Hash checkpoint to " << fname << " failed" << sync_endl;
+  }
+  else if (blocks)
+      sync_cout << "info string Hash checkpoint: " << blocks << " of " << blockCount << " blocks ("
+                << format_bytes(written, 2) << ") written to " << fname << " in "
+                << now() - start << " ms" << (interrupted ? ", interrupted" : "") << sync_endl;
+}
+
+
+/// TranspositionTable::merge() implements the merge_hash command, which merges
+/// several hash files into a new table of the given size and saves it:
+///
+///   merge_hash <target> <sizeMB> <file1> [file2] ... [fileN]
+///
+/// The blocks of all the inputs are streamed by as many threads as there are
+/// cores, each entry is inserted with the replacement rule of probe(): when
+/// two entries compete for a slot, the one with the higher depth minus age is
+/// kept. Ages are taken relative to the generation of each file, so entries
+/// from files saved at different points of an analysis compare fairly. With
+/// 16 bit keys the cluster of an entry cannot be recomputed, so only tables
+/// of the target size can be merged.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::merge(int argc, char* argv[]) {
+
+  if (argc < 3 || atoi(argv[1]) <= 0)
+  {
+      sync_cout << "info string Error : Incorrect merge_hash command" << sync_endl;
+      sync_cout << "info string Syntax: merge_hash <target> <sizeMB> <filename1> [filename2] ... [filenameX]" << sync_endl;
+      return;
+  }
+
+  const string target = Utility::map_path(Utility::unquote(argv[0]));
+  const size_t mbSize = size_t(atoi(argv[1]));
+  constexpr bool FullKeys = sizeof(typename Layout::EntryKey) == sizeof(Key);
+
+  struct Input {
+    string fname;
+    HashFileHeader h;
+    uint32_t firstChunk;
+  };
+
+  std::vector<Input> inputs;
+  size_t chunkCount = 0;
+
+  for (int i = 2; i < argc; ++i)
+  {
+      Input in;
+      in.fname = Utility::map_path(Utility::unquote(argv[i]));
+
+      std::ifstream f(in.fname, std::ios::in | std::ios::binary | std::ios::ate);
+      const size_t fileSize = f ? size_t(f.tellg()) : 0;
+      f.seekg(0);
+
+      if (!f.read(reinterpret_cast<char*>(&in.h), sizeof(in.h)))
+          sync_cout << "info string Could not open hash file " << in.fname << sync_endl;
+
+      else if (!FullKeys && in.h.clusterCount != mbSize * 1024 * 1024 / sizeof(Cluster))
+          sync_cout << "info string Hash file " << in.fname
+                    << " has another size than the target, skipped (16 bit keys)" << sync_endl;
+
+      else if (check_header(in.h, fileSize, sizeof(Cluster), sizeof(Entry), in.fname))
+      {
+          in.firstChunk = uint32_t(chunkCount);
+          chunkCount += in.h.blockCount;
+          inputs.push_back(in);
+      }
+  }
+
+  if (inputs.empty())
+      return;
+
+  sync_cout << "\nMerging hash files: ";
+  for (const Input& in : inputs)
+      std::cout << "\n\t" << in.fname << " (" << format_bytes(in.h.clusterCount * sizeof(Cluster), 2) << ")";
+
+  std::cout << "\nTarget file: " << target << " (" << format_bytes(mbSize * 1024 * 1024, 2) << ")\n" << sync_endl;
+
+  const TimePoint start = now();
+
+  resize(mbSize);
+
+  // Clusters are updated under striped spinlocks, contention is negligible
+  constexpr size_t LockCount = 4096;
+  std::vector<std::atomic<bool>> locks(LockCount);
+  std::atomic<size_t> entries(0), stored(0), badBlocks(0);
+
+  auto value = [&](const Entry& e) {
+      return e.depth8 - ((GENERATION_CYCLE + generation8 - e.genBound8) & GENERATION_MASK);
+  };
+
+  auto insert = [&](Entry e, size_t cluster) {
+
+      if (FullKeys)
+          cluster = ((e.key * (__uint128_t)clusterCount) >> 64);
+
+      Entry* const tte = &table[cluster].entry[0];
+      std::atomic<bool>& lock = locks[cluster % LockCount];
+      Entry* replace = nullptr;
+      bool found = false;
+
+      while (lock.exchange(true, std::memory_order_acquire)) {}
+
+      for (int i = 0; i < ClusterSize && !found; ++i)
+          if (tte[i].key == e.key && tte[i].depth8)
+          {
+              found = true;
+              replace = value(e) > value(tte[i]) ? &tte[i] : nullptr;
+          }
+          else if (!tte[i].depth8 && !replace)
+              replace = &tte[i];
+
+      if (!found && !replace)
+      {
+          replace = tte;
+          for (int i = 1; i < ClusterSize; ++i)
+              if (value(*replace) > value(tte[i]))
+                  replace = &tte[i];
+
+          if (value(e) <= value(*replace))
+              replace = nullptr;
+      }
+
+      if (replace)
+          *replace = e, ++stored;
+
+      lock.store(false, std::memory_order_release);
+  };
+
+  // Each block of an input file is a task of the thread pool
+  Threads.parallel_for(chunkCount, [&](size_t c) {
+
+      const size_t i = std::upper_bound(inputs.begin(), inputs.end(), c,
+                                        [](size_t v, const Input& in) { return v < in.firstChunk; }) - inputs.begin() - 1;
+      const HashFileHeader& h = inputs[i].h;
+      const size_t b = c - inputs[i].firstChunk;
+      const size_t dataSize = h.clusterCount * sizeof(Cluster);
+      const size_t len = std::min(size_t(h.blockSize), dataSize - b * h.blockSize);
+      std::ifstream f(inputs[i].fname, std::ios::in | std::ios::binary);
+      std::vector<char> buffer(len);
+      uint32_t crc;
+
+      f.seekg(HashFileDataOffset + dataSize + b * sizeof(uint32_t));
+      f.read(reinterpret_cast<char*>(&crc), sizeof(crc));
+      f.seekg(HashFileDataOffset + b * h.blockSize);
+
+      // Blocks of a mapped table may legitimately differ from their checksum
+      if (   !f.read(buffer.data(), len)
+          || (crc32(buffer.data(), len) != crc && !(h.flags & HF_MAPPED)))
+      {
+          ++badBlocks;
+          return;
+      }
+
+      const Cluster* cl = reinterpret_cast<const Cluster*>(buffer.data());
+      const size_t firstCluster = b * h.blockSize / sizeof(Cluster);
+      size_t localEntries = 0;
+
+      for (size_t n = 0; n < len / sizeof(Cluster); ++n)
+          for (const Entry& e : cl[n].entry)
+              if (e.depth8)
+              {
+                  // Re-base the age of the entry on the generation of the merged table
+                  Entry te = e;
+                  const int age = (GENERATION_CYCLE + h.generation - te.genBound8) & GENERATION_MASK;
+                  te.genBound8 = uint8_t(((generation8 - age) & GENERATION_MASK) | (te.genBound8 & (GENERATION_DELTA - 1)));
+
+                  insert(te, firstCluster + n);
+                  ++localEntries;
+              }
+
+      entries += localEntries;
+  });
+
+  sync_cout << "info string " << entries << " entries read, " << stored << " stored"
+            << (badBlocks ? ", " + std::to_string(badBlocks) + " corrupted blocks skipped" : "")
+            << " in " << now() - start << " ms" << sync_endl;
+
+  if (save(target))
+      sync_cout << "info string Merged hash file saved: " << target << sync_endl;
 }
 
 enum { SAN_MOVE_NORMAL, SAN_PAWN_CAPTURE };
@@ -222,13 +1016,16 @@ Move san_to_move(Position& pos, std::string& str)
 	bool capture = false;
 	Move move = MOVE_NONE;
 
-	size_t idx = uci.find_first_of("+#");
+	if (str.size() < 2)
+		return MOVE_NONE;
+
+	size_t idx = uci.find_first_of("+#!?");
 	if (idx != std::string::npos) {
 		uci.erase(idx); // erase to end of the string
 	}
 	idx = uci.find_first_of("=");
 	if (idx != std::string::npos) {
-		char promo = uci.at(idx);
+		char promo = idx + 1 < uci.size() ? uci.at(idx + 1) : ' ';
 		switch (promo) {
 		case 'Q': promotion = QUEEN; break;
 		case 'R': promotion = ROOK; break;
@@ -238,7 +1035,7 @@ Move san_to_move(Position& pos, std::string& str)
 		}
 		uci.erase(idx);
 	}
-	else { // check the last char, is it QRBN?
+	else if (!uci.empty()) { // check the last char, is it QRBN?
 		char promo2 = uci.at(uci.size() - 1);
 		switch (promo2) {
 		case 'Q': promotion = QUEEN; break;
@@ -258,7 +1055,6 @@ Move san_to_move(Position& pos, std::string& str)
 
 	char piece = str.at(0);
 	PieceType piecetype;
-	std::string thepiece;
 
 	switch (piece) {
 	case 'N': piecetype = KNIGHT; break;
@@ -272,76 +1068,82 @@ Move san_to_move(Position& pos, std::string& str)
 	default: piecetype = PAWN;
 	}
 
-	if (castles) { // chess 960?
-		if (uci == "0-0" || uci == "O-O") {
-			if (pos.side_to_move() == WHITE) {
-				move = make<CASTLING>(SQ_E1, SQ_H1);
-			}
-			else {
-				move = make<CASTLING>(SQ_E8, SQ_H8);
-			}
-		}
-		else if (uci == "0-0-0" || uci == "O-O-O") {
-			if (pos.side_to_move() == WHITE) {
-				move = make<CASTLING>(SQ_E1, SQ_A1);
-			}
-			else {
-				move = make<CASTLING>(SQ_E8, SQ_A8);
-			}
-		}
+	if (castles) { // The king takes the rook, which also covers chess 960
+		Color us = pos.side_to_move();
+		CastlingRights cr =  uci == "0-0"   || uci == "O-O"   ? us & KING_SIDE
+		                   : uci == "0-0-0" || uci == "O-O-O" ? us & QUEEN_SIDE : NO_CASTLING;
+
+		if (cr == NO_CASTLING || !pos.can_castle(cr))
+			return MOVE_NONE; // invalid
+
+		move = make<CASTLING>(pos.square<KING>(us), pos.castling_rook_square(cr));
 		if (pos.pseudo_legal(move) && pos.legal(move)) {
 			return move;
 		}
 		return MOVE_NONE; // invalid
 	}
 
+	if (uci.size() < 2)
+		return MOVE_NONE; // invalid
+
 	// normal move or promotion
 	int torank = uci.at(uci.size() - 1) - '1';
 	int tofile = uci.at(uci.size() - 2) - 'a';
 	int disambig_r = -1;
 	int disambig_f = -1;
-	if (piecetype != PAWN && piecetype != KING && uci.size() > 3) {
-		char ambig = uci.at(uci.size() - 3);
-		if (ambig >= 'a' && ambig <= 'h') {
-			disambig_f = ambig - 'a';
-		}
-		else if (ambig >= '1' && ambig <= '8') {
-			disambig_r = ambig - '1';
-		}
-		else {
-			return MOVE_NONE; // invalid;
+
+	if (torank < 0 || torank > 7 || tofile < 0 || tofile > 7)
+		return MOVE_NONE; // invalid
+
+	if (piecetype == PAWN && capture) {
+		// The file of a capturing pawn is always given, as in exd5
+		disambig_f = uci.at(0) - 'a';
+	}
+	else if (piecetype != PAWN && piecetype != KING) {
+		// Up to a file and a rank between the piece letter and the target square, as in Nbd7, R1e2 or Qh4e1
+		for (size_t k = 1; k + 2 < uci.size(); ++k) {
+			char ambig = uci.at(k);
+			if (ambig >= 'a' && ambig <= 'h') {
+				disambig_f = ambig - 'a';
+			}
+			else if (ambig >= '1' && ambig <= '8') {
+				disambig_r = ambig - '1';
+			}
+			else {
+				return MOVE_NONE; // invalid;
+			}
 		}
 	}
 
-	Square tosquare = Square((torank * 8) + tofile);
-	Bitboard bb;	
+	Square tosquare = make_square(File(tofile), Rank(torank));
+	Color us = pos.side_to_move();
+	Bitboard bb;
 
+	// Only the pieces of the right type which can reach the target square are tried
 	switch (piecetype)
 	{
 	case PAWN:
+		bb = pos.pieces(us, PAWN) & (capture ? pawn_attacks_bb(~us, tosquare) : file_bb(tosquare));
+		break;
 	case KNIGHT:
 	case BISHOP:
 	case ROOK:
 	case QUEEN:
 	case KING:
-		bb = pos.pieces(pos.side_to_move(), piecetype);
+		bb = pos.pieces(us, piecetype) & attacks_bb(piecetype, tosquare, pos.pieces());
 		break;
 	default:
 		return MOVE_NONE; // invalid
 	}
 
-	int piececount = popcount(bb);
 	while (bb)
 	{
 		Square s = pop_lsb(bb);
 
-		if (piececount > 1 && (disambig_r >= 0 || disambig_f >= 0))
-		{
-			if (disambig_r >= 0 && rank_of(s) != Rank(disambig_r))
-				continue;
-			else if (disambig_f >= 0 && file_of(s) == File(disambig_f))
-				continue;
-		}
+		if (disambig_r >= 0 && rank_of(s) != Rank(disambig_r))
+			continue;
+		else if (disambig_f >= 0 && file_of(s) != File(disambig_f))
+			continue;
 
 		if (piecetype != PAWN || !capture)
 			move = test_move<SAN_MOVE_NORMAL>(pos, s, tosquare, promotion);
@@ -373,66 +1175,159 @@ Value uci_to_score(std::string &str)
 	return v;
 }
 
-void TranspositionTable::load_epd_to_hash() {
-	std::string line;
-	std::ifstream myfile(hashfilename);
-	Position pos;
-	Move bm;
-	int ce;
-	int depth;
-	generation8 = 4; //for storing the positions
+namespace {
 
-	if (myfile.is_open())
-	{
-		while (getline(myfile, line))
-		{
-			std::vector<std::string> x = split(line, ';');
-
-			//extract and set position
-			std::size_t i = x[0].find("acd"); //depth searched. Is after the fen string
-			StateListPtr states(new std::deque<StateInfo>(1));
-			sync_cout << x[0].substr(0, i) << sync_endl;
-			pos.set(x[0].substr(0, i), Options["UCI_Chess960"], &states->back(), Threads.main());
-			
-			//depth
-			depth = std::stoi(x[0].substr(i + 4));
-			sync_cout << depth << sync_endl;
-
-			bm = MOVE_NONE;
-			ce = -1000000;
-
-			for (std::vector<int>::size_type j = 1; j <= x.size(); j++) {
-				if (bm == MOVE_NONE) {
-					i = x[j].find("bm ");
-					if (i == 1) {
-						sync_cout << x[j].substr(i + 3) << sync_endl;
-						std::string stri = x[j].substr(i + 3);
-						bm = san_to_move(pos, stri);
-						if (bm != MOVE_NONE)
-							sync_cout << "move ok" << sync_endl;
-						continue;
-					}
-				}
-				if (ce == -1000000) {
-					i = x[j].find("ce ");
-					if (i == 1) {
-						std::string stri = x[j].substr(i + 3);
-						ce = uci_to_score(stri);
-						sync_cout << "ce " << ce << sync_endl;
-						continue;
-					}
-				}
-			}
+  // store_epd() sets up the position of an EPD line and saves it in the table
+  // with the "acd" (depth) and "ce" (score) operations, both required, and the
+  // first "bm" (best move) if any. Returns false if the line is not usable.
+  bool store_epd(Position& pos, StateInfo& st, const string& line, bool chess960) {
 
-			TTEntry* tte;
-			bool ttHit;
-			tte = TT.probe(pos.key(), ttHit);
+    std::istringstream ss(line);
+    std::vector<string> ops;
+    string fen, op, token;
+    int fields = 0;
 
-			tte->save(pos.key(), (Value)ce, true, BOUND_EXACT, (Depth)depth, 
-				bm, VALUE_NONE);
-		}
-		myfile.close();
-	}
+    // The four EPD fields, maybe followed by the FEN move counters, then the
+    // operations separated by semicolons.
+    while (ss >> token)
+    {
+        if (fields < 4 || (fields < 6 && op.empty() && std::isdigit(token[0])))
+        {
+            fen += token + " ";
+            ++fields;
+            continue;
+        }
+
+        const bool last = token.back() == ';';
+        if (last)
+            token.pop_back();
+
+        if (!token.empty())
+            op += (op.empty() ? "" : " ") + token;
+
+        if (last && !op.empty())
+            ops.push_back(op), op.clear();
+    }
+
+    if (!op.empty())
+        ops.push_back(op);
+
+    if (fields < 4)
+        return false;
+
+    pos.set(fen, chess960, &st, Threads.main());
+
+    if (popcount(pos.pieces(WHITE, KING)) != 1 || popcount(pos.pieces(BLACK, KING)) != 1)
+        return false;
+
+    int depth = 0;
+    Value ce = VALUE_NONE;
+    Move bm = MOVE_NONE;
+
+    for (const string& o : ops)
+    {
+        std::istringstream os(o);
+        string opcode, operand;
+        os >> opcode >> operand;
+
+        if (opcode == "acd")
+            depth = std::atoi(operand.c_str());
+
+        else if (opcode == "ce" && !operand.empty())
+            ce = std::clamp(uci_to_score(operand), -VALUE_MATE, VALUE_MATE);
+
+        else if (opcode == "bm" && bm == MOVE_NONE && !operand.empty())
+            bm = san_to_move(pos, operand);
+    }
+
+    if (depth <= 0 || ce == VALUE_NONE)
+        return false;
+
+    bool ttHit;
+    TTEntry* tte = TT.probe(pos.key(), ttHit);
+    tte->save(pos.key(), ce, true, BOUND_EXACT, Depth(std::min(depth, int(MAX_PLY))), bm, VALUE_NONE);
+
+    return true;
+  }
+
+} // namespace
+
+
+/// TranspositionTable::load_epd_to_hash() stores the analysed positions of the
+/// EPD file named by HashFile into the table. The file is split in byte ranges
+/// of a few MB which are processed in parallel on the thread pool. The lines
+/// starting in a range are parsed with the Position of the task and saved the
+/// way the search does, without locking. Progress is reported every few seconds.
+
+template<typename Layout>
+void TranspositionTableT<Layout>::load_epd_to_hash() {
+
+  Threads.main()->wait_for_search_finished();
+
+  std::ifstream in(hashfilename, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!in)
+  {
+      sync_cout << "info string Could not open EPD file " << hashfilename << sync_endl;
+      return;
+  }
+
+  const size_t fileSize = size_t(in.tellg());
+  in.close();
+
+  constexpr size_t RangeSize = 4 * 1024 * 1024;
+
+  const TimePoint start = now();
+  const size_t rangeCount = (fileSize + RangeSize - 1) / RangeSize;
+  const bool chess960 = Options["UCI_Chess960"];
+  std::atomic<size_t> bytesDone(0), stored(0), skipped(0);
+  std::atomic<TimePoint> lastReport(start);
+
+  Threads.parallel_for(rangeCount, [&](size_t idx) {
+
+      const size_t begin = idx * RangeSize,
+                   end   = std::min(begin + RangeSize, fileSize);
+
+      std::ifstream f(hashfilename, std::ios::in | std::ios::binary);
+      Position pos;
+      StateInfo st;
+      string line;
+      size_t offset = begin, lines = 0, localStored = 0;
+
+      // A line belongs to the range of its first character: skip the end
+      // of the line started in the previous range.
+      if (begin)
+      {
+          f.seekg(begin - 1);
+          std::getline(f, line);
+          offset += line.size();
+      }
+
+      while (offset < end && std::getline(f, line))
+      {
+          offset += line.size() + 1;
+
+          if (!line.empty() && line.back() == '\r')
+              line.pop_back();
+
+          if (line.empty() || line[0] == '#')
+              continue;
+
+          ++lines;
+          localStored += store_epd(pos, st, line, chess960);
+      }
+
+      bytesDone += end - begin;
+      stored += localStored;
+      skipped += lines - localStored;
+
+      TimePoint last = lastReport;
+      if (now() - last >= 5000 && lastReport.compare_exchange_strong(last, now()))
+          sync_cout << "info string LoadEpdToHash: " << 100 * bytesDone / std::max(fileSize, size_t(1))
+                    << "% of " << hashfilename << sync_endl;
+  });
+
+  sync_cout << "info string LoadEpdToHash: " << stored << " positions stored, " << skipped
+            << " lines skipped from " << hashfilename << " in " << now() - start << " ms" << sync_endl;
 }
 
 /// TranspositionTable::probe() looks up the current position in the transposition
@@ -442,11 +1337,14 @@ void TranspositionTable::load_epd_to_hash() {
 /// minus 8 times its relative age. TTEntry t1 is considered more valuable than
 /// TTEntry t2 if its replace value is greater than that of t2.
 
-TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
+template<typename Layout>
+typename TranspositionTableT<Layout>::Entry* TranspositionTableT<Layout>::probe(const Key key, bool& found) const {
+
+  Entry* const tte = first_entry(key);
+  const auto entryKey = typename Layout::EntryKey(key);
 
-  TTEntry* const tte = first_entry(key);
   for (int i = 0; i < ClusterSize; ++i)
-      if (tte[i].key == key || !tte[i].depth8)
+      if (tte[i].key == entryKey || !tte[i].depth8)
       {
           tte[i].genBound8 = uint8_t(generation8 | (tte[i].genBound8 & (GENERATION_DELTA - 1))); // Refresh
 
@@ -454,7 +1352,7 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
       }
 
   // Find an entry to be replaced according to the replacement strategy
-  TTEntry* replace = tte;
+  Entry* replace = tte;
   for (int i = 1; i < ClusterSize; ++i)
       // Due to our packed storage format for generation and its cyclic
       // nature we add GENERATION_CYCLE (256 is the modulus, plus what
@@ -472,7 +1370,8 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
 /// TranspositionTable::hashfull() returns an approximation of the hashtable
 /// occupation during a search. The hash is x permill full, as per UCI protocol.
 
-int TranspositionTable::hashfull() const {
+template<typename Layout>
+int TranspositionTableT<Layout>::hashfull() const {
 
   int cnt = 0;
   for (int i = 0; i < 1000; ++i)
@@ -482,4 +1381,8 @@ int TranspositionTable::hashfull() const {
   return cnt / ClusterSize;
 }
 
+// Only the layout selected at compile time is built
+template struct TTEntryT<TTClusterLayout::EntryKey>;
+template class TranspositionTableT<TTClusterLayout>;
+
 } // namespace Stockfish
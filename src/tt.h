@@ -19,14 +19,20 @@
 #ifndef TT_H_INCLUDED
 #define TT_H_INCLUDED
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include "misc.h"
 #include "types.h"
 
 namespace Stockfish {
 
-/// TTEntry struct is the 16 bytes transposition table entry, defined as below:
+/// TTEntryT struct is the transposition table entry, defined as below:
 ///
-/// key        64 bit
+/// key        64 or 16 bit
 /// depth       8 bit
 /// generation  5 bit
 /// pv node     1 bit
@@ -34,8 +40,12 @@ namespace Stockfish {
 /// move       16 bit
 /// value      16 bit
 /// eval value 16 bit
+///
+/// With a 16 bit key the entry takes 10 bytes instead of 16, the upper bits of
+/// the key are implied by the index of the cluster.
 
-struct TTEntry {
+template<typename KeyType>
+struct TTEntryT {
 
   Move  move()  const { return (Move )move16; }
   Value value() const { return (Value)value16; }
@@ -47,9 +57,9 @@ struct TTEntry {
   void save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev);
 
 private:
-  friend class TranspositionTable;
+  template<typename> friend class TranspositionTableT;
 
-  uint64_t key;
+  KeyType  key;
   uint8_t  depth8;
   uint8_t  genBound8;
   uint16_t move16;
@@ -58,21 +68,45 @@ private:
 };
 
 
+/// The cluster layouts, selected at compile time by TT_LAYOUT (see ttlayout in
+/// the Makefile). Clusters are aligned to their size so that a cluster never
+/// straddles two cache lines.
+///
+/// TTLayout2x16: 2 entries of 16 bytes in 32 bytes (default)
+/// TTLayout3x10: 3 entries of 10 bytes in 32 bytes, 16 bit keys
+/// TTLayout4x16: 4 entries of 16 bytes in 64 bytes, a whole cache line
+
+template<typename KeyType, int Entries, int Bytes>
+struct TTLayout {
+  using EntryKey = KeyType;
+  using Entry = TTEntryT<KeyType>;
+  static constexpr int ClusterSize  = Entries;
+  static constexpr int ClusterBytes = Bytes;
+};
+
+using TTLayout2x16 = TTLayout<uint64_t, 2, 32>;
+using TTLayout3x10 = TTLayout<uint16_t, 3, 32>;
+using TTLayout4x16 = TTLayout<uint64_t, 4, 64>;
+
+
 /// A TranspositionTable is an array of Cluster, of size clusterCount. Each
 /// cluster consists of ClusterSize number of TTEntry. Each non-empty TTEntry
 /// contains information on exactly one position. The size of a Cluster should
 /// divide the size of a cache line for best performance, as the cacheline is
 /// prefetched when possible.
 
-class TranspositionTable {
+template<typename Layout>
+class TranspositionTableT {
 
-  static constexpr int ClusterSize = 2;
+  using Entry = typename Layout::Entry;
+  static constexpr int ClusterSize = Layout::ClusterSize;
 
-  struct Cluster {
-    TTEntry entry[ClusterSize];
+  struct alignas(Layout::ClusterBytes) Cluster {
+    Entry entry[ClusterSize];
   };
 
-  static_assert(sizeof(Cluster) == 32, "Unexpected Cluster size");
+  static_assert(sizeof(Entry) == 10 || sizeof(Entry) == 16, "Unexpected TTEntry size");
+  static_assert(sizeof(Cluster) == Layout::ClusterBytes, "Unexpected Cluster size");
 
   // Constants used to refresh the hash table periodically
   static constexpr unsigned GENERATION_BITS  = 3;                                // nb of bits reserved for other things
@@ -81,33 +115,80 @@ class TranspositionTable {
   static constexpr int      GENERATION_MASK  = (0xFF << GENERATION_BITS) & 0xFF; // mask to pull out generation number
 
 public:
- ~TranspositionTable() { aligned_large_pages_free(table); }
+  // Unit of the checksums in the hash file and of the checkpoint dirty map
+  static constexpr size_t BlockSize = 1024 * 1024;
+
+ ~TranspositionTableT() { set_checkpoint(0, 0); free_table(); }
   void new_search() { generation8 += GENERATION_DELTA; } // Lower bits are used for other things
   void infinite_search() { generation8 += GENERATION_DELTA; }
   uint8_t generation() const { return generation8; }
-  TTEntry* probe(const Key key, bool& found) const;
+  Entry* probe(const Key key, bool& found) const;
   int hashfull() const;
   void resize(size_t mbSize);
   void clear();
   void set_hash_file_name(const std::string& fname);
-  bool save();
+  bool save() { return save(hashfilename); }
+  bool save(const std::string& fname);
   void load();
+  bool is_mapped() const { return hashFile.is_mapped(); }
   void load_epd_to_hash();
+  void set_checkpoint(int minutes, int mbPerSecond);
+  void merge(int argc, char* argv[]);
   std::string hashfilename = "hash.hsh";
 
   // The key is used to get the index of the cluster
-  TTEntry* first_entry(const Key key) const {
+  Entry* first_entry(const Key key) const {
     return &table[(key * (__uint128_t)clusterCount) >> 64].entry[0];
   }
 
 private:
-  friend struct TTEntry;
+  friend Entry;
+
+  bool map(const std::string& fname);
+  void allocate(size_t newClusterCount);
+  void free_table();
+  void reset_dirty(uint8_t v);
+  void checkpoint_loop();
+  void checkpoint();
+  std::unique_lock<std::recursive_mutex> pause_checkpoint();
+
+  // Called by TTEntry::save() while checkpointing, checks before storing so
+  // that the flag's cache line is not written over and over again.
+  void mark_dirty(const Entry* tte) {
+    std::atomic<uint8_t>& d = dirty[size_t(reinterpret_cast<const char*>(tte) - reinterpret_cast<const char*>(table)) / BlockSize];
+    if (!d.load(std::memory_order_relaxed))
+        d.store(1, std::memory_order_relaxed);
+  }
 
   size_t clusterCount;
   Cluster* table;
+  MemoryMappedFile hashFile; // Backing file when the table is mapped from disk
   uint8_t generation8; // Size must be not bigger than TTEntry::genBound8
+
+  // Background checkpointing: one dirty flag per block of the table, the blocks
+  // flagged since the last checkpoint are written to the hash file.
+  std::unique_ptr<std::atomic<uint8_t>[]> dirtyBlocks;
+  size_t dirtyBlockCount = 0;
+  std::atomic<uint8_t>* dirty = nullptr; // dirtyBlocks while checkpointing, else nullptr
+  std::recursive_mutex tableMutex;       // Held by a checkpoint while it reads the table
+  std::mutex checkpointMutex;
+  std::condition_variable checkpointCv;
+  std::thread checkpointThread;
+  std::atomic<bool> checkpointAbort{false}, checkpointExit{false};
+  int checkpointMinutes = 0, checkpointBandwidth = 0;
 };
 
+#if TT_LAYOUT == 1
+using TTClusterLayout = TTLayout3x10;
+#elif TT_LAYOUT == 2
+using TTClusterLayout = TTLayout4x16;
+#else
+using TTClusterLayout = TTLayout2x16;
+#endif
+
+using TTEntry = TTClusterLayout::Entry;
+using TranspositionTable = TranspositionTableT<TTClusterLayout>;
+
 extern TranspositionTable TT;
 
 } // namespace Stockfish
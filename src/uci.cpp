@@ -16,11 +16,15 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <iomanip>
 #include <iostream>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 
 #include "evaluate.h"
 #include "movegen.h"
@@ -32,6 +36,7 @@
 #include "uci.h"
 #include "syzygy/tbprobe.h"
 #include "experience.h"
+#include "polybook.h"
 
 using namespace std;
 
@@ -44,6 +49,21 @@ namespace {
   // FEN string of the initial position, normal chess
   const char* StartFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
+  // Command line tools which run their bulk work on the thread pool
+  const set<string> PoolTools = { "defrag", "merge", "merge_hash", "convert_compact_pgn",
+                                  "book_export", "book_from_exp", "book_from_pgn",
+                                  "book_merge", "evalbatch" };
+
+
+  // size_pool_for_tools() gives the thread pool one thread per hardware thread,
+  // the calling thread included since it also works in parallel_for(). The
+  // tools run alone, nothing else needs the cores.
+
+  void size_pool_for_tools() {
+
+    Options["Threads"] = to_string(clamp(thread::hardware_concurrency(), 2u, 513u) - 1);
+  }
+
 
   // position() is called when engine receives the "position" UCI command.
   // The function sets up the position described in the given FEN string ("fen")
@@ -158,19 +178,19 @@ namespace {
   }
 
 
-  // bench() is called when engine receives the "bench" command. Firstly
-  // a list of UCI commands is setup according to bench parameters, then
-  // it is run one by one printing a summary at the end.
+  // run_bench() executes the UCI commands of a bench list. It returns the number
+  // of nodes searched and sets 'elapsed' to the time taken in ms. If 'stats' is
+  // given, the statistics counters of every search are added to it.
 
-  void bench(Position& pos, istream& args, StateListPtr& states) {
+  uint64_t run_bench(Position& pos, const vector<string>& list, StateListPtr& states, TimePoint& elapsed,
+                     uint64_t* stats = nullptr) {
 
     string token;
     uint64_t num, nodes = 0, cnt = 1;
 
-    vector<string> list = setup_bench(pos, args);
     num = count_if(list.begin(), list.end(), [](string s) { return s.find("go ") == 0 || s.find("eval") == 0; });
 
-    TimePoint elapsed = now();
+    elapsed = now();
 
     for (const auto& cmd : list)
     {
@@ -185,6 +205,10 @@ namespace {
                go(pos, is, states);
                Threads.main()->wait_for_search_finished();
                nodes += Threads.nodes_searched();
+
+               if (stats)
+                   for (int i = 0; i < STAT_NB; ++i)
+                       stats[i] += Threads.stat(StatsCounter(i));
             }
             else
                trace_eval(pos);
@@ -196,6 +220,19 @@ namespace {
 
     elapsed = now() - elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
 
+    return nodes;
+  }
+
+  // bench() is called when engine receives the "bench" command. Firstly
+  // a list of UCI commands is setup according to bench parameters, then
+  // it is run one by one printing a summary at the end.
+
+  void bench(Position& pos, istream& args, StateListPtr& states) {
+
+    vector<string> list = setup_bench(pos, args);
+    TimePoint elapsed;
+    uint64_t nodes = run_bench(pos, list, states, elapsed);
+
     dbg_print(); // Just before exiting
 
     cerr << "\n==========================="
@@ -204,6 +241,51 @@ namespace {
          << "\nNodes/second    : " << 1000 * nodes / elapsed << endl;
   }
 
+  // pawn_bench() is called when engine receives the "pawnbench" command, which
+  // takes the same parameters as "bench". The bench is run first with the
+  // per-thread pawn tables only and then with the shared pawn hash, of "Pawn Hash"
+  // MB or 16 MB if not set, and the speeds are compared, together with the pawn
+  // hash hit rates in builds with statistics (see the "stats" command).
+  // The pawn hash is only used by the classical evaluation.
+
+  void pawn_bench(Position& pos, istream& args, StateListPtr& states) {
+
+    vector<string> list = setup_bench(pos, args);
+    string pawnHash = to_string(int(Options["Pawn Hash"]));
+    string sizes[] = { "0", pawnHash != "0" ? pawnHash : "16" };
+    ostringstream report;
+
+    for (const string& size : sizes)
+    {
+        Options["Pawn Hash"] = size;
+
+        TimePoint elapsed;
+        uint64_t stats[STAT_NB] = {};
+        uint64_t nodes = run_bench(pos, list, states, elapsed, stats);
+
+        report << "\n" << left << setw(15) << (size == "0" ? "Per-thread" : "Shared " + size + " MB")
+               << fixed << setprecision(2);
+#ifdef USE_STATS
+        uint64_t probes = std::max(stats[STAT_PAWN_PROBES], uint64_t(1));
+        uint64_t sharedHits = stats[STAT_PAWN_SHARED_HITS], misses = stats[STAT_PAWN_MISSES];
+
+        report << ": probes " << probes
+               << " thread hits " << 100.0 * (probes - sharedHits - misses) / probes << "%"
+               << " shared hits " << 100.0 * sharedHits / probes << "%"
+               << " misses " << 100.0 * misses / probes << "%";
+#endif
+        report << " nodes/second " << 1000 * nodes / elapsed;
+    }
+
+    Options["Pawn Hash"] = pawnHash;
+
+#ifndef USE_STATS
+    report << "\nBuild with 'make build stats=yes' for the pawn hash hit rates";
+#endif
+
+    cerr << "\n===========================" << report.str() << endl;
+  }
+
   // The win rate model returns the probability (per mille) of winning given an eval
   // and a game-ply. The model fits rather accurately the LTC fishtest statistics.
   int win_rate_model(Value v, int ply) {
@@ -255,6 +337,9 @@ void UCI::loop(int argc, char* argv[]) {
       token.clear(); // Avoid a stale if getline() returns empty or blank line
       is >> skipws >> token;
 
+      if (argc > 2 && PoolTools.count(token))
+          size_pool_for_tools();
+
       if (    token == "quit"
           ||  token == "stop")
           Threads.stop = true;
@@ -287,14 +372,29 @@ void UCI::loop(int argc, char* argv[]) {
       // Do not use these commands during a search!
       else if (token == "flip")     pos.flip();
       else if (token == "bench")    bench(pos, is, states);
+      else if (token == "pawnbench") pawn_bench(pos, is, states);
+      else if (token == "nnuebench")
+      {
+          int iterations;
+          Eval::NNUE::bench_layers(pos, (is >> iterations) ? iterations : 1000000);
+      }
       else if (token == "d")        sync_cout << pos << sync_endl;
       else if (token == "eval")     trace_eval(pos);
       else if (token == "compiler") sync_cout << compiler_info() << sync_endl;
+      else if (token == "latency")  Threads.print_latency();
+      else if (token == "stats")    Threads.print_stats(true);
       else if (argc > 2 && token == "defrag")   Experience::defrag(argc - 2, argv + 2);
       else if (argc > 2 && token == "merge")    Experience::merge(argc - 2, argv + 2);
+      else if (argc > 2 && token == "merge_hash") TT.merge(argc - 2, argv + 2);
       else if (token == "exp")                  Experience::show_exp(pos, false);
       else if (token == "expex")                Experience::show_exp(pos, true);
       else if (argc > 2 && token == "convert_compact_pgn") Experience::convert_compact_pgn(argc - 2, argv + 2);
+      else if (argc > 2 && token == "book_export") PolyBook::export_tree(argc - 2, argv + 2);
+      else if (argc > 2 && token == "book_from_exp") PolyBook::build_from_exp(argc - 2, argv + 2);
+      else if (argc > 2 && token == "book_from_pgn") PolyBook::build_from_pgn(argc - 2, argv + 2);
+      else if (argc > 2 && token == "book_merge") PolyBook::merge_books(argc - 2, argv + 2);
+      else if (argc > 2 && token == "evalbatch") Eval::NNUE::evaluate_batch_file(argc - 2, argv + 2);
+      else if (argc > 2 && token == "prepare_net") Eval::NNUE::prepare_net(argc - 2, argv + 2);
       else if (token == "export_net")
       {
           std::optional<std::string> filename;
@@ -42,14 +42,18 @@ namespace UCI {
 /// 'On change' actions, triggered by an option's value change
 void on_clear_hash(const Option&) { Search::clear(); }
 void on_hash_size(const Option& o) { TT.resize(size_t(o)); }
+void on_hash_numa(const Option&) { TT.resize(size_t(Options["Hash"])); }
 void on_logger(const Option& o) { start_logger(o); }
 void on_threads(const Option& o) { Threads.set(size_t(o)); }
 void on_full_threads(const Option& o) { Threads.setFull(o); }
+void on_spin_time(const Option& o) { Threads.spinTime = int(o); }
+void on_pawn_hash(const Option& o) { Pawns::resize_shared(size_t(o)); }
 void on_tb_path(const Option& o) { Tablebases::init(o); }
 void on_HashFile(const Option& o) { TT.set_hash_file_name(o); }
 void SaveHashtoFile(const Option&) { TT.save(); }
 void LoadHashfromFile(const Option&) { TT.load(); }
 void LoadEpdToHash(const Option&) { TT.load_epd_to_hash(); }
+void on_hash_checkpoint(const Option&) { TT.set_checkpoint(int(Options["HashCheckpointInterval"]), int(Options["HashCheckpointBandwidth"])); }
 void on_book1_file(const Option& o) { polybook[0].init(o); }
 void on_book2_file(const Option& o) { polybook[1].init(o); }
 void on_exp_enabled(const Option& /*o*/) { Experience::init(); }
@@ -78,16 +82,22 @@ void init(OptionsMap& o) {
   o["Threads"]                           << Option(1, 1, 512, on_threads);
   o["BruteForceSearch"]                  << Option(0, 0, 512, on_full_threads); //if this is used, must be after #Threads is set.
   o["Hash"]                              << Option(16, 1, MaxHashMB, on_hash_size);
+  o["HashNumaInterleave"]                << Option(false, on_hash_numa);
+  o["Pawn Hash"]                         << Option(0, 0, 4096, on_pawn_hash);
   o["Clear Hash"]                        << Option(on_clear_hash);
   o["Clean Search"]                      << Option(false);
   o["Ponder"]                            << Option(false);
   o["MultiPV"]                           << Option(1, 1, 500);
   o["Move Overhead"]                     << Option(10, 0, 5000);
+  o["Thread Spin Time"]                  << Option(0, 0, 10000, on_spin_time);
   o["Slow Mover"]                        << Option(100, 10, 1000);
   o["nodestime"]                         << Option(0, 0, 10000);
   o["UCI_Chess960"]                      << Option(false);
   o["NeverClearHash"]                    << Option(false);
   o["HashFile"]                          << Option("hash.hsh", on_HashFile);
+  o["HashFileMapped"]                    << Option(false);
+  o["HashCheckpointInterval"]            << Option(0, 0, 1440, on_hash_checkpoint);
+  o["HashCheckpointBandwidth"]           << Option(64, 0, 10000, on_hash_checkpoint);
   o["SaveHashtoFile"]                    << Option(SaveHashtoFile);
   o["LoadHashfromFile"]                  << Option(LoadHashfromFile);
   o["LoadEpdToHash"]                     << Option(LoadEpdToHash);